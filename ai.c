@@ -64,29 +64,39 @@ compare_analysis(const void *ap, const void *bp)
  * moves found.  Sort the result by position value such that the best
  * move is first (i.e. the move leading to the worst position for the
  * opponent).  The strength member indicates the engine strength used
- * for computing the value member.
+ * for computing the value member.  If the positions could not be looked
+ * up, return -1 with errno set (see lookup_positions()).
  */
-extern size_t
+extern ssize_t
 analyze_position(struct analysis an[MAX_MOVES],
     const struct tablebase *tb, const struct position *p, double strength)
 {
-	struct position pp;
+	struct position pp[MAX_MOVES];
 	struct move moves[MAX_MOVES];
 	double total = 0.0;
-	size_t i, nmove;
+	size_t i, nmove, nlookup = 0, index[MAX_MOVES];
+	tb_entry entries[MAX_MOVES];
 
+	/* look up all positions that don't end the game at once */
 	nmove = generate_moves(moves, p);
 	for (i = 0; i < nmove; i++) {
-		pp = *p;
 		an[i].move = moves[i];
-		if (play_move(&pp, moves + i))
+		pp[nlookup] = *p;
+		if (play_move(pp + nlookup, moves + i))
 			an[i].entry = 1;
 		else
-			an[i].entry = prev_dtm(lookup_position(tb, &pp));
+			index[nlookup++] = i;
+	}
+
+	if (lookup_successors(tb, pp, nlookup, entries) != 0)
+		return (-1);
 
+	for (i = 0; i < nlookup; i++)
+		an[index[i]].entry = prev_dtm(entries[i]);
+
+	for (i = 0; i < nmove; i++)
 		total += an[i].value = an[i].entry == 0.0 ?
 		    1.0 : exp(strength / an[i].entry);
-	}
 
 	assert(nmove == 0 || total > 0);
 
@@ -96,7 +106,7 @@ analyze_position(struct analysis an[MAX_MOVES],
 
 	qsort(an, nmove, sizeof *an, compare_analysis);
 
-	return (nmove);
+	return ((ssize_t)nmove);
 }
 
 /*
@@ -104,20 +114,25 @@ analyze_position(struct analysis an[MAX_MOVES],
  * position evaluations from tb.  strength indicates the AI strength,
  * an integer between 0 (play random moves) and MAX_STRENGTH.  If
  * strength is equal to or larger than MAX_STRENGTH, the AI plays
- * perfectly.
+ * perfectly.  The move is stored in m.  Return 0 on success or -1 with
+ * errno set if the position could not be analyzed.
  */
-extern struct move
-ai_move(const struct tablebase *tb, const struct position *p,
+extern int
+ai_move(struct move *m, const struct tablebase *tb, const struct position *p,
     struct seed *s, double strength)
 {
 	struct analysis an[MAX_MOVES];
 	double rngval;
-
+	ssize_t count;
 	size_t i, nmove;
 
 	assert(strength >= 0);
 
-	nmove = analyze_position(an, tb, p, strength);
+	count = analyze_position(an, tb, p, strength);
+	if (count == -1)
+		return (-1);
+
+	nmove = (size_t)count;
 
 	/*
 	 * While there are two positions where no moves are available,
@@ -138,18 +153,22 @@ ai_move(const struct tablebase *tb, const struct position *p,
 
 		assert(0 <= i && i < nmove);
 
-		return (an[i].move);
+		*m = an[i].move;
+		return (0);
 	}
 
 	/* select random move according to evaluation */
 	rngval = erand48(s->xsubi);
 	for (i = 0; i < nmove; i++) {
-		if (rngval < an[i].value)
-			return an[i].move;
-		else
+		if (rngval < an[i].value) {
+			*m = an[i].move;
+			return (0);
+		} else
 			rngval -= an[i].value;
 	}
 
 	/* due to rounding errors, it might happen that no value matches */
-	return (an[0].move);
+	*m = an[0].move;
+
+	return (0);
 }
@@ -32,7 +32,16 @@
  *
  * These macros define the following macros and types:
  *  atomic_schar -- an atomic signed char type
+ *  atomic_uchar -- an atomic unsigned char type
+ *  atomic_ullong -- an atomic unsigned long long type
  *  atomic_exchange() -- a C11 like atomic exchange macro
+ *  atomic_fetch_or() -- a C11 like atomic fetch-and-or macro
+ *  atomic_fetch_sub() -- a C11 like atomic fetch-and-subtract macro
+ *  atomic_load() -- a C11 like atomic load macro
+ *  atomic_store() -- a C11 like atomic store macro
+ *  atomic_compare_exchange_strong() -- a C11 like compare-and-swap
+ *      function, only available for atomic_ullong if C11 atomics are
+ *      not available
  */
 
 /* clang uses this */
@@ -49,11 +58,36 @@ _Static_assert(sizeof (atomic_schar) == 1,
     || defined(__GNUC__) && __GNUC__ >= 4
 /* gcc __sync functions */
 typedef volatile signed char atomic_schar;
+typedef volatile unsigned char atomic_uchar;
+typedef volatile unsigned long long atomic_ullong;
 # define atomic_exchange __sync_lock_test_and_set
+# define atomic_fetch_or __sync_fetch_and_or
+# define atomic_fetch_sub __sync_fetch_and_sub
+/* plain loads and stores of long long might tear on some platforms */
+# define atomic_load(x) __sync_fetch_and_add((x), 0)
+# define atomic_store(x, c) ((void)__sync_lock_test_and_set((x), (c)))
+
+static inline int
+atomic_compare_exchange_strong(atomic_ullong *x, unsigned long long *expected,
+    unsigned long long desired)
+{
+	unsigned long long old;
+
+	old = __sync_val_compare_and_swap(x, *expected, desired);
+	if (old == *expected)
+		return (1);
+
+	*expected = old;
+	return (0);
+}
 #else
 /* no atomic primitives */
 #define NO_ATOMICS
 typedef signed char atomic_schar;
+typedef unsigned char atomic_uchar;
+typedef unsigned long long atomic_ullong;
+# define atomic_load(x) (*(x))
+# define atomic_store(x, c) ((void)(*(x) = (c)))
 
 
 static inline
@@ -64,6 +98,37 @@ atomic_schar atomic_exchange(atomic_schar *x, atomic_schar c)
 	*x = c;
 	return (old);
 }
+
+static inline
+atomic_uchar atomic_fetch_or(atomic_uchar *x, atomic_uchar c)
+{
+	atomic_uchar old = *x;
+
+	*x |= c;
+	return (old);
+}
+
+static inline
+atomic_uchar atomic_fetch_sub(atomic_uchar *x, atomic_uchar c)
+{
+	atomic_uchar old = *x;
+
+	*x -= c;
+	return (old);
+}
+
+static inline int
+atomic_compare_exchange_strong(atomic_ullong *x, unsigned long long *expected,
+    unsigned long long desired)
+{
+	if (*x == *expected) {
+		*x = desired;
+		return (1);
+	}
+
+	*expected = *x;
+	return (0);
+}
 #endif
 
 #endif /* ATOMICS_H */
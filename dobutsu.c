@@ -25,11 +25,14 @@
 #define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <locale.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <readline/readline.h>
@@ -75,9 +78,31 @@ static double sente_strength = 1, gote_strength = 1;
 static struct seed seed;
 static char *linebuf = NULL;
 
+/*
+ * The tablebase is loaded in the background by load_tablebase() while
+ * the user enters commands.  tb_lock protects tb and tbload, tb_done
+ * is signalled when loading finished.  location is the name of the
+ * file, loading is set while the load is in progress, error is the
+ * errno value of a failed load, reported is set once the failure has
+ * been reported, and start and end are the times the load started and
+ * ended.
+ */
+static pthread_mutex_t tb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tb_done = PTHREAD_COND_INITIALIZER;
+static struct {
+	const char *location;
+	int loading, error, reported;
+	struct timespec start, end;
+} tbload;
+
 /* internal functions */
 static void	usage(const char *);
 static void	open_tablebase(const char *);
+static void	*load_tablebase(void *);
+static struct tablebase *need_tablebase(void);
+static const char *load_error(int);
+static const char *lookup_error(int);
+static char	*cache_directory(void);
 static void	execute_command(char *);
 static void	end_game(void);
 static void	cmd_hint(const char *);
@@ -89,6 +114,7 @@ static void	cmd_show_moves(void);
 static void	cmd_show_eval(void);
 static void	cmd_show_lines(void);
 static void	cmd_show_setup(void);
+static void	cmd_show_status(void);
 static void	cmd_strength(const char *);
 static void	cmd_undo(const char *);
 static void	cmd_remove(const char *);
@@ -151,6 +177,7 @@ static const struct {
 	cmd_show_eval,	"eval",
 	cmd_show_lines,	"lines",
 	cmd_show_setup,	"setup",
+	cmd_show_status, "status",
 	NULL,		""
 };
 
@@ -160,23 +187,35 @@ static const struct {
 static void
 usage(const char *argv0)
 {
-	fprintf(stderr, gettext("Usage: %s [-qv] [-c color] [-s strength[,strength]] [-t tbfile.tb]\n"), argv0);
+	fprintf(stderr, gettext("Usage: %s [-qv] [-b budget] [-c color] [-j nproc] [-m memory] [-s strength[,strength]] [-t tbfile.tb]\n"), argv0);
 	exit(EXIT_FAILURE);
 }
 
 extern int
 main(int argc, char *argv[])
 {
-	int optchar;
+	long threads;
+	size_t budget;
+	int optchar, flags;
 	unsigned char players = 0;
+	char *endptr;
 	char *tbloc = getenv("DOBUTSU_TABLEBASE");
 
 	setlocale(LC_ALL, "");
 	bindtextdomain("dobutsu", LOCALEDIR);
 	textdomain("dobutsu");
 
-	while (optchar = getopt(argc, argv, "c:qs:t:v"), optchar != EOF)
+	while (optchar = getopt(argc, argv, "b:c:j:m:qs:t:v"), optchar != EOF)
 		switch (optchar) {
+		case 'b':
+			if (parse_size(optarg, &budget) != 0) {
+				fprintf(stderr, "%s\n", gettext("invalid cache budget"));
+				return (EXIT_FAILURE);
+			}
+
+			set_tablebase_cache(budget);
+			break;
+
 		case 'c':
 			while (*optarg != '\0')
 				switch (*optarg++) {
@@ -201,6 +240,26 @@ main(int argc, char *argv[])
 
 			break;
 
+		case 'j':
+			threads = strtol(optarg, &endptr, 0);
+			if (*optarg == '\0' || *endptr != '\0' || threads <= 0) {
+				fprintf(stderr, "%s\n", gettext("invalid number of threads"));
+				return (EXIT_FAILURE);
+			}
+
+			set_tablebase_decoder(threads > UINT_MAX ? UINT_MAX : threads, 0);
+			break;
+
+		case 'm':
+			flags = parse_tablebase_memory(optarg);
+			if (flags == -1) {
+				fprintf(stderr, "%s\n", gettext("invalid memory options"));
+				return (EXIT_FAILURE);
+			}
+
+			set_tablebase_memory(flags);
+			break;
+
 		case 'q':
 			show_board_after_move = 0;
 			break;
@@ -265,14 +324,19 @@ main(int argc, char *argv[])
 /*
  * Open the endgame tablebase in file tbloc.  If tbloc is NULL,
  * try opening a file named dobutsu.tb in the current working
- * directory.  If that doesn't work either, give up.
+ * directory.  If that doesn't work either, give up.  The tablebase
+ * is read in the background, commands needing it wait for it through
+ * need_tablebase().
  */
 static void
 open_tablebase(const char *tbloc)
 {
 	FILE *tbfile;
+	pthread_t thread;
+	static char *cachedir;
 
-	printf(gettext("Loading tablebase... "));
+	cachedir = cache_directory();
+	set_tablebase_cachedir(cachedir);
 
 	if (tbloc != NULL)
 		tbfile = fopen(tbloc, "rb");
@@ -285,15 +349,159 @@ open_tablebase(const char *tbloc)
 		}
 	}
 
-	if (tbfile != NULL) {
-		tb = read_tablebase(tbfile);
-		fclose(tbfile);
+	tbload.location = tbloc;
+	if (tbfile == NULL) {
+		tbload.error = errno;
+		printf(gettext("Loading tablebase... "));
+		printf("%s: %s\n", tbloc, errno == 0 ? gettext("Unknown error") : strerror(errno));
+		tbload.reported = 1;
+		return;
 	}
 
-	if (tb != NULL)
-		puts(gettext("done"));
+	tbload.loading = 1;
+	clock_gettime(CLOCK_MONOTONIC, &tbload.start);
+	if (pthread_create(&thread, NULL, load_tablebase, tbfile) == 0)
+		pthread_detach(thread);
 	else
-		printf("%s: %s\n", tbloc, errno == 0 ? gettext("Unknown error") : strerror(errno));
+		load_tablebase(tbfile);
+}
+
+/*
+ * Read the tablebase from tbfile_arg, a FILE *, and record the result
+ * in tb and tbload.
+ */
+static void *
+load_tablebase(void *tbfile_arg)
+{
+	struct tablebase *newtb;
+	FILE *tbfile = tbfile_arg;
+	int error;
+
+	errno = 0;
+	newtb = read_tablebase(tbfile);
+	error = errno;
+	fclose(tbfile);
+
+	pthread_mutex_lock(&tb_lock);
+	tb = newtb;
+	tbload.error = error;
+	tbload.loading = 0;
+	clock_gettime(CLOCK_MONOTONIC, &tbload.end);
+	pthread_cond_broadcast(&tb_done);
+	pthread_mutex_unlock(&tb_lock);
+
+	return (NULL);
+}
+
+/*
+ * Wait for the tablebase to be loaded and return it.  If it could not
+ * be loaded, report why the first time and return NULL.
+ */
+static struct tablebase *
+need_tablebase(void)
+{
+	struct tablebase *loaded;
+
+	pthread_mutex_lock(&tb_lock);
+	while (tbload.loading)
+		pthread_cond_wait(&tb_done, &tb_lock);
+
+	loaded = tb;
+	if (loaded == NULL && !tbload.reported) {
+		printf(gettext("Loading tablebase... "));
+		printf("%s: %s\n", tbload.location, load_error(tbload.error));
+		tbload.reported = 1;
+	}
+
+	pthread_mutex_unlock(&tb_lock);
+
+	return (loaded);
+}
+
+/*
+ * Describe error, the reason why the tablebase could not be loaded.
+ * Tablebases written before the tablebase container was introduced
+ * have no header and are rejected with EINVAL like damaged ones, so
+ * the user is told to regenerate the tablebase in that case.
+ */
+static const char *
+load_error(int error)
+{
+
+	if (error == 0)
+		return (gettext("Unknown error"));
+	else if (error == EINVAL)
+		return (gettext("not a tablebase of this version of dobutsu, regenerate it with gentb"));
+	else
+		return (strerror(error));
+}
+
+/*
+ * Describe error, the reason why a lookup in the tablebase failed.
+ * Blocks of a lazily decompressed tablebase are only checked when they
+ * are first used, so a damaged one is found out about only then.
+ */
+static const char *
+lookup_error(int error)
+{
+
+	if (error == EINVAL)
+		return (gettext("tablebase damaged"));
+	else
+		return (strerror(error));
+}
+
+/*
+ * Find the directory to keep a decompressed copy of a compressed
+ * tablebase in.  This is the directory named by DOBUTSU_CACHE if set,
+ * dobutsu in XDG_CACHE_HOME if set, or .cache/dobutsu in the home
+ * directory.  The directory is only created once a copy is made (see
+ * cache_tablebase()).  If DOBUTSU_CACHE is set to the empty string or
+ * no directory can be found, return NULL.  Otherwise, return the name
+ * of the directory in a buffer allocated with malloc().
+ */
+static char *
+cache_directory(void)
+{
+	size_t len;
+	char *dir, *parent, *env;
+
+	env = getenv("DOBUTSU_CACHE");
+	if (env != NULL) {
+		if (*env == '\0')
+			return (NULL);
+
+		return (strdup(env));
+	}
+
+	env = getenv("XDG_CACHE_HOME");
+	if (env != NULL && *env != '\0')
+		parent = strdup(env);
+	else {
+		env = getenv("HOME");
+		if (env == NULL || *env == '\0')
+			return (NULL);
+
+		len = strlen(env) + sizeof "/.cache";
+		parent = malloc(len);
+		if (parent != NULL)
+			snprintf(parent, len, "%s/.cache", env);
+	}
+
+	if (parent == NULL)
+		return (NULL);
+
+	len = strlen(parent) + sizeof "/dobutsu";
+	dir = malloc(len);
+	if (dir == NULL) {
+		free(parent);
+		return (NULL);
+	}
+
+	snprintf(dir, len, "%s/dobutsu", parent);
+	free(parent);
+
+	return (dir);
 }
 
 /*
@@ -464,7 +672,7 @@ autoplay(void)
 	char movstr[MAX_MOVSTR];
 
 	while (engine_moves()) {
-		if (tb == NULL) {
+		if (need_tablebase() == NULL) {
 			error(gettext("tablebase unavailable"));
 			engine_players = ENGINE_NONE;
 			return;
@@ -472,7 +680,12 @@ autoplay(void)
 
 		strength = gote_moves(&gs->position) ? gote_strength : sente_strength;
 
-		engine_move = ai_move(tb, &gs->position, &seed, strength);
+		if (ai_move(&engine_move, tb, &gs->position, &seed, strength) != 0) {
+			error(lookup_error(errno));
+			engine_players = ENGINE_NONE;
+			return;
+		}
+
 		move_string(movstr, &gs->position, &engine_move);
 		old_clock = gs->move_clock;
 		end = play(engine_move);
@@ -501,12 +714,16 @@ cmd_hint(const char *arg)
 
 	(void)arg;
 
-	if (tb == NULL) {
+	if (need_tablebase() == NULL) {
 		error(gettext("tablebase unavailable"));
 		return;
 	}
 
-	aim = ai_move(tb, &gs->position, &seed, strength);
+	if (ai_move(&aim, tb, &gs->position, &seed, strength) != 0) {
+		error(lookup_error(errno));
+		return;
+	}
+
 	move_string(movstr, &gs->position, &aim);
 	puts(movstr);
 }
@@ -522,8 +739,15 @@ cmd_exit(const char *arg)
 	(void)arg;
 
 	end_game();
-	free_tablebase(tb);
-	tb = NULL;
+
+	/* a tablebase still being loaded is left alone */
+	pthread_mutex_lock(&tb_lock);
+	if (!tbload.loading) {
+		free_tablebase(tb);
+		tb = NULL;
+	}
+
+	pthread_mutex_unlock(&tb_lock);
 	free(linebuf);
 
 	if (ferror(stdin)) {
@@ -592,12 +816,16 @@ cmd_show_eval(void)
 {
 	tb_entry eval;
 
-	if (tb == NULL) {
+	if (need_tablebase() == NULL) {
 		error(gettext("tablebase unavailable"));
 		return;
 	}
 
-	eval = lookup_position(tb, &gs->position);
+	if (lookup_position(tb, &gs->position, &eval) != 0) {
+		error(lookup_error(errno));
+		return;
+	}
+
 	if (is_win(eval))
 		printf("#%d\n", get_dtm(eval));
 	else if (is_loss(eval))
@@ -614,15 +842,20 @@ cmd_show_lines(void)
 {
 	struct analysis analysis[MAX_MOVES];
 	double strength = gote_moves(&gs->position) ? gote_strength : sente_strength;
-	size_t i, nmove;
+	ssize_t i, nmove;
 	char movstr[MAX_MOVSTR], dtmstr[6];
 
-	if (tb == NULL) {
+	if (need_tablebase() == NULL) {
 		error(gettext("tablebase unavailable"));
 		return;
 	}
 
 	nmove = analyze_position(analysis, tb, &gs->position, strength);
+	if (nmove == -1) {
+		error(lookup_error(errno));
+		return;
+	}
+
 	for (i = 0; i < nmove; i++) {
 		move_string(movstr, &gs->position, &analysis[i].move);
 		if (is_draw(analysis[i].entry))
@@ -648,6 +881,37 @@ cmd_show_setup(void)
 	puts(render);
 }
 
+/*
+ * Print how far loading the tablebase got and how fast it went.
+ */
+static void
+cmd_show_status(void)
+{
+	struct timespec end;
+	size_t done, total;
+	double elapsed, rate;
+
+	pthread_mutex_lock(&tb_lock);
+	if (tbload.loading)
+		clock_gettime(CLOCK_MONOTONIC, &end);
+	else
+		end = tbload.end;
+
+	get_tablebase_progress(&done, &total);
+	elapsed = (end.tv_sec - tbload.start.tv_sec) + (end.tv_nsec - tbload.start.tv_nsec) * 1.0e-9;
+	rate = elapsed > 0.0 ? done / elapsed / 1.0e6 : 0.0;
+
+	if (tbload.loading)
+		printf(gettext("Tablebase: loading, %.1f of %.1f MB (%.1f MB/s)\n"),
+		    done / 1.0e6, total / 1.0e6, rate);
+	else if (tb != NULL)
+		printf(gettext("Tablebase: loaded in %.2f s (%.1f MB/s)\n"), elapsed, rate);
+	else
+		printf(gettext("Tablebase: unavailable (%s)\n"), load_error(tbload.error));
+
+	pthread_mutex_unlock(&tb_lock);
+}
+
 /*
  * The strength command lets you set the engine strength.  If no operand
  * is provided, the current engine strength is printed.  If one operand
@@ -775,6 +1039,7 @@ cmd_help(const char *arg)
 	    "show moves  print possible moves\n"
 	    "show eval   print position evaluation\n"
 	    "show lines  print possible moves and their evaluations\n"
+	    "show status print how far loading the tablebase got\n"
 	    "strength    show/set engine strength\n"
 	    "both        make engine play both players\n"
 	    "go          make the engine play the colour that is on the move\n"
@@ -23,6 +23,8 @@
  * SUCH DAMAGE.
  */
 #include <assert.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #include "atomics.h"
 #include "tablebase.h"
@@ -50,19 +52,24 @@
  * The following constants describe how many of each encoding level
  * exist.  If some values of an encoding level are possible but not
  * stored in the endgame tablebase, a corresponding _TOTAL macro is
- * present as well.
+ * present as well.  If the program is compiled with FULL_TABLEBASE
+ * defined, all ownership classes are stored.
  */
 enum {
 	COHORT_COUNT = 63,
 	LIONPOS_COUNT = 21,
 	LIONPOS_TOTAL_COUNT = 41,
+#ifdef FULL_TABLEBASE
+	OWNERSHIP_COUNT = 64,
+#else
 	OWNERSHIP_COUNT = 42,
+#endif
 	OWNERSHIP_TOTAL_COUNT = 64,
 
 
 	/* total positions in the table base */
 	POSITION_TOTAL_COUNT = 255280704,
-	/* number of positions saved to disk (167527962) */
+	/* number of positions saved to disk (167527962 or 255280704) */
 	POSITION_COUNT = POSITION_TOTAL_COUNT / OWNERSHIP_TOTAL_COUNT * OWNERSHIP_COUNT,
 
 	MAX_PCALIAS = 16,
@@ -115,17 +122,180 @@ extern const unsigned long long valid_ownership_map[COHORT_COUNT];
  * with an equal or higher amount of pieces for Sente appear first.
  * This table contains a permutation of the ownership values such that
  * does values where Sente owns not less than three pieces are first.
+ * The value of a position in any other ownership class is derived from
+ * its successors on lookup, unless FULL_TABLEBASE is defined, in which
+ * case the other classes are stored, too.
  */
 extern const unsigned char ownership_map[OWNERSHIP_TOTAL_COUNT];
 
+/*
+ * Most of the POSITION_COUNT slots of the table (see position_offset())
+ * are never looked up: those of poscodes with invalid ownership, those
+ * of poscodes that are not canonical (see is_canonical()), and those of
+ * positions where the lion of the player not to move can be captured.
+ * Only the entries of the other LIVE_COUNT (live) positions are stored,
+ * in the order of their slots.  The live bitmap has a bit for each
+ * slot, bit i being bit i % 8 of byte i / 8, that is set if the
+ * position in the slot is live.  The entry of the live position in
+ * slot i is the rank of i, that is, the number of live positions
+ * before it.  To find it in constant time, ranks holds for each block
+ * of LIVE_BLOCK slots the number of live positions before that block
+ * in its lower 32 bits and for each 64 bit word j of the block the
+ * number of live positions before that word within the block in bits
+ * 32 + 8j to 39 + 8j, so only the live positions before the slot
+ * within its word are counted on lookup.  If the bitmap had to be
+ * copied out of the table, copy points to it and is released with the
+ * ranks.  See tblive.c for details.
+ */
+enum {
+	LIVE_BLOCK = 256,
+#ifdef FULL_TABLEBASE
+	LIVE_COUNT = 109213029,
+#else
+	LIVE_COUNT = 59383681,
+#endif
+	LIVE_SIZE = (POSITION_COUNT + LIVE_BLOCK - 1) / LIVE_BLOCK * (LIVE_BLOCK / 8),
+};
+
+struct tblive {
+	const unsigned char *bits;
+	uint64_t *ranks;
+	unsigned char *copy;
+};
+
 /*
  * The tablebase struct contains a complete tablebase. It is essentially
- * just a huge array of position evaluations (win/draw/loss).
+ * just a huge array of position evaluations (win/draw/loss).  size is
+ * the number of bytes in the array.  It holds the data of a tablebase
+ * file (TB_DATA_SIZE bytes), that is, the entries of the live
+ * positions followed by the live bitmap, and live is set up for the
+ * bitmap.  A tablebase being generated instead holds an entry for each
+ * slot and live.ranks is NULL.  If positions was obtained from
+ * mmap(), mapping is the length of the mapping, otherwise it is 0.  If
+ * the tablebase is decompressed lazily, positions is NULL and cache
+ * refers to the cache of decompressed blocks, otherwise cache is NULL.
+ * If the tablebase has been packed with pack_tablebase(), positions is
+ * NULL and pack refers to the packed table, otherwise pack is NULL.
+ * If wdl is nonzero, positions holds a win/draw/loss bitbase instead
+ * of the distances to mate (see below) and live is not used.
  */
 struct tablebase {
-	atomic_schar positions[POSITION_COUNT];
+	atomic_schar *positions;
+	size_t size, mapping;
+	struct tbcache *cache;
+	struct tbpack *pack;
+	struct tblive live;
+	int wdl;
 };
 
+/*
+ * A packed tablebase stores the TBPACK_CODES most common values of the
+ * table as 4 bit codes, two positions per byte with the lower nibble
+ * holding the position with the even offset.  All other values are
+ * replaced by the code TBPACK_ESCAPE and stored in escapes, a table
+ * of escaped values sorted by offset.  To find the escaped value of a
+ * position in constant time, ranks holds for each block of TBPACK_BLOCK
+ * positions the number of escaped positions before that block, the
+ * escaped positions before the position within its block are counted
+ * on lookup.  A block of codes is as large as a cache line.  values
+ * holds the value of each code.  See tbpack.c for details.
+ */
+enum {
+	TBPACK_CODES = 15,
+	TBPACK_ESCAPE = 15,
+	TBPACK_BLOCK = 128,
+};
+
+struct tbpack {
+	unsigned char *codes;
+	uint32_t *ranks;
+	signed char *escapes;
+	size_t nescape;
+	signed char values[TBPACK_CODES];
+};
+
+/*
+ * Tablebase files are containers made of a header of TB_HEADER_SIZE
+ * bytes, TB_DATA_SIZE bytes of data, and an index of TB_INDEX_SIZE
+ * bytes.  The data are the LIVE_COUNT entries of the live positions,
+ * padded to a multiple of the block size of the live bitmap, followed
+ * by the bitmap.  The header identifies the format and the layout of
+ * the table, the index holds the location and a checksum of each
+ * section, that is, of the entries of each stored ownership class, and
+ * of the bitmap.  Only the first TB_HEADER_LEN bytes of the header are
+ * used; the header is padded so the data can be mapped into memory.
+ * See tbformat.c for details.
+ */
+enum {
+	TB_VERSION = 3,
+	TB_HEADER_LEN = 88,
+	TB_HEADER_SIZE = 1 << 16,
+	TB_SECTION_SIZE = POSITION_TOTAL_COUNT / OWNERSHIP_TOTAL_COUNT,
+	TB_LIVE_OFFSET = (LIVE_COUNT + LIVE_BLOCK / 8 - 1) / (LIVE_BLOCK / 8) * (LIVE_BLOCK / 8),
+	TB_DATA_SIZE = TB_LIVE_OFFSET + LIVE_SIZE,
+	TB_INDEX_SIZE = (OWNERSHIP_COUNT + 1) * 32 + 8,
+	TB_FILE_SIZE = TB_HEADER_SIZE + TB_DATA_SIZE + TB_INDEX_SIZE,
+};
+
+/*
+ * A win/draw/loss bitbase stores only whether each position of the
+ * tablebase is a win, a draw, or a loss, in 2 bits per position.  The
+ * entry of the position at offset i is stored in bits 2 * (i % 4) and
+ * 2 * (i % 4) + 1 of byte i / 4 and is one of the WDL_* constants.
+ * Bitbase files are made of a header of TB_HEADER_SIZE bytes of which
+ * the first WDL_HEADER_LEN bytes are used, followed by the WDL_SIZE
+ * bytes of entries.  If a tablebase has been read from a bitbase,
+ * wdl is set in struct tablebase and positions holds the entries.
+ * The distance to mate is then recovered by a search of at most
+ * BITBASE_DEPTH moves.  See tbwdl.c for details.
+ */
+enum {
+	WDL_DRAW = 0,
+	WDL_WIN = 1,
+	WDL_LOSS = 2,
+
+	WDL_HEADER_LEN = 64,
+	WDL_SIZE = (POSITION_COUNT + 3) / 4,
+
+	BITBASE_DEPTH = 5,
+};
+
+extern		void			 make_tbheader(unsigned char *);
+extern		int			 check_tbheader(const unsigned char *);
+extern		uint64_t		 layout_fingerprint(void);
+extern		void			 make_tbindex(unsigned char *, const uint64_t *, const size_t *,
+					     const unsigned *);
+extern		int			 check_tbindex(const unsigned char *, uint64_t *, unsigned *);
+extern		int			 verify_sections(struct tablebase *, const uint64_t *, const unsigned *);
+extern		void			 make_wdlheader(unsigned char *, uint64_t);
+extern		int			 check_wdlheader(const unsigned char *, uint64_t *);
+extern		struct tablebase	*read_bitbase(FILE *);
+extern		void			 bitbase_entries(const struct tablebase *, const struct position *,
+					     size_t, tb_entry *, int);
+
+extern		struct tablebase	*alloc_tablebase(size_t);
+extern		struct tablebase	*map_tablebase(int, off_t, size_t);
+extern		struct tablebase	*open_cached_tablebase(FILE *);
+extern		struct tablebase	*share_tablebase(FILE *, int (*)(FILE *, struct tablebase *));
+extern		struct tablebase	*cache_tablebase(FILE *, const char *,
+					    int (*)(FILE *, struct tablebase *));
+extern		int			 get_tablebase_memory(void);
+extern		int			 cached_entries(struct tbcache *, const size_t *, size_t, tb_entry *);
+extern		void			 free_tablebase_cache(struct tbcache *);
+extern		int			 pack_tablebase(struct tablebase *);
+extern		void			 free_tablebase_pack(struct tbpack *);
+static inline	tb_entry		 packed_entry(const struct tbpack *, size_t);
+extern		int			 index_live(struct tblive *, const unsigned char *);
+extern		void			 free_live(struct tblive *);
+extern		void			 predict_live(unsigned char *, const unsigned *);
+extern		void			 restore_live(unsigned char *, const unsigned *);
+static inline	size_t			 live_rank(const struct tblive *, size_t);
+
+/* scanning kernels, see tbscan.c */
+extern		void			scan_wdl(atomic_schar*, size_t, unsigned*, unsigned*, unsigned*);
+extern		void			scan_equal(const atomic_schar*, size_t, tb_entry, atomic_uchar*);
+extern		size_t			scan_nonzero(const atomic_uchar*, size_t, size_t);
+
 /*
  * A poscode (position code) is an encoded position directly suitable as
  * an index into the endgame tablebase.  A typedef is provided so we can
@@ -152,6 +322,11 @@ struct tablebase {
  *  - pieces of the same kind are interchanged such that the _G piece
  *    always occupies a higher square than the _S piece where "in hand"
  *    is a higher square than all other squares.
+ *
+ * If both lions are on the B file, the board is flipped if that
+ * makes it compare lower, so a position and its mirror image have the
+ * same poscode.  The entries of the poscodes of the other board (see
+ * is_canonical()) are unused.
  */
 typedef struct {
 	unsigned ownership;
@@ -162,7 +337,8 @@ typedef struct {
 
 extern		void			encode_position(poscode*, const struct position*);
 extern		void			decode_poscode(struct position*, poscode);
-extern		int			position_mirror(struct position*);
+extern		poscode			offset_poscode(size_t);
+extern		int			is_canonical(poscode);
 static inline	size_t			position_offset(poscode);
 static inline	int			has_valid_ownership(poscode);
 
@@ -188,6 +364,72 @@ position_offset(poscode pc)
 	return (index);
 }
 
+/*
+ * packed_entry() returns the entry at offset in the packed tablebase
+ * pack.  The codes before offset in its block are read 16 at a time
+ * and the escape codes among them are counted to find the entry in
+ * the escape table if needed.
+ */
+static inline tb_entry
+packed_entry(const struct tbpack *pack, size_t offset)
+{
+	const unsigned char *block;
+	uint64_t word, escapes = 0;
+	size_t i, j, n;
+	unsigned code;
+
+	code = pack->codes[offset / 2] >> 4 * (offset % 2) & 0xf;
+	if (code != TBPACK_ESCAPE)
+		return (pack->values[code]);
+
+	block = pack->codes + offset / TBPACK_BLOCK * (TBPACK_BLOCK / 2);
+	n = offset % TBPACK_BLOCK;
+	for (i = 0; i < n; i += 16) {
+		word = 0;
+		for (j = 8; j-- > 0; )
+			word = word << 8 | block[i / 2 + j];
+
+		/* one bit per code that is TBPACK_ESCAPE (all bits set) */
+		word &= word >> 1;
+		word &= word >> 2;
+		word &= 0x1111111111111111ULL;
+		if (n - i < 16)
+			word &= (1ULL << 4 * (n - i)) - 1;
+
+		word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+		escapes += word * 0x0101010101010101ULL >> 56;
+	}
+
+	return (pack->escapes[pack->ranks[offset / TBPACK_BLOCK] + escapes]);
+}
+
+/*
+ * live_rank() returns the number of live positions before slot in the
+ * table described by live, which is where the entry of the position in
+ * slot is stored.  Only the bits before slot in its 64 bit word need
+ * to be counted.
+ */
+static inline size_t
+live_rank(const struct tblive *live, size_t slot)
+{
+	const unsigned char *bits;
+	uint64_t rank, word = 0;
+	size_t j;
+
+	rank = live->ranks[slot / LIVE_BLOCK];
+	bits = live->bits + slot / 64 * 8;
+	for (j = 8; j-- > 0; )
+		word = word << 8 | bits[j];
+
+	word &= (1ULL << slot % 64) - 1;
+	word -= word >> 1 & 0x5555555555555555ULL;
+	word = (word & 0x3333333333333333ULL) + (word >> 2 & 0x3333333333333333ULL);
+	word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+
+	return ((rank & 0xffffffff) + (rank >> (32 + 8 * (slot % LIVE_BLOCK / 64)) & 0xff)
+	    + (word * 0x0101010101010101ULL >> 56));
+}
+
 /*
  * To reduce the computational load, we only consider poscodes where for
  * each kind of piece, if both pieces are in hand, the _G piece is owned
@@ -26,25 +26,86 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "tablebase.h"
 
 /*
  * Generate the Dobutsu Shogi endgame tablebase, optionally in parallel.
- * The option -j nproc can be used to set the number of threads.
+ * The option -j nproc can be used to set the number of threads.  The
+ * option -e engine selects the generation engine, either verify (the
+ * default) or count.  With -c checkpoint, the generator state is saved
+ * to the file checkpoint every -i interval rounds (default 10).  The
+ * option -r checkpoint resumes generation from a checkpoint.  With -p,
+ * threads are pinned to CPUs and the table is placed on the NUMA nodes
+ * of the threads using it.  The option -m memory controls how memory
+ * for the table is allocated.  With -t telemetry, statistics about
+ * every round are written to the file telemetry as JSON lines.  With
+ * -z preset, the table base is written compressed with xz using the
+ * given preset, e.g. 4e for xz -4 -e.  The option -b blocksize sets
+ * the size of the independently compressed blocks; small blocks allow
+ * lazy decompression of the table base.  With -x, the live bitmap of
+ * each ownership class is stored predicted from a similar class, which
+ * makes the compressed table base smaller.  With -w bitbase, a win/draw/loss
+ * bitbase is written to the file bitbase, too.
  */
 extern int
 main(int argc, char *argv[])
 {
 	struct tablebase *tb;
-	FILE *tbfile;
-	long threads = 1;
-	int optchar;
+	struct gentb_options opts;
+	FILE *tbfile, *wdlfile = NULL;
+	long threads = 1, interval = 10;
+	int optchar, flags = TBMEM_DEFAULT, predict = 0;
 	char *endptr;
 
-	while(optchar = getopt(argc, argv, "j:"), optchar != -1)
+	opts.engine = GENTB_ENGINE_VERIFY;
+	opts.checkpoint = NULL;
+	opts.resume = NULL;
+	opts.pin = 0;
+	opts.telemetry = NULL;
+	opts.compression = TB_UNCOMPRESSED;
+	opts.block_size = 0;
+
+	while(optchar = getopt(argc, argv, "b:c:e:i:j:m:pr:t:w:xz:"), optchar != -1)
 		switch(optchar) {
+		case 'b':
+			if (parse_size(optarg, &opts.block_size) != 0 || opts.block_size == 0) {
+				fprintf(stderr, "Invalid block size %s\n", optarg);
+				return (EXIT_FAILURE);
+			}
+
+			break;
+
+		case 'c':
+			opts.checkpoint = optarg;
+			break;
+
+		case 'e':
+			if (strcmp(optarg, "verify") == 0)
+				opts.engine = GENTB_ENGINE_VERIFY;
+			else if (strcmp(optarg, "count") == 0)
+				opts.engine = GENTB_ENGINE_COUNT;
+			else {
+				fprintf(stderr, "Unknown engine %s, expected verify or count\n", optarg);
+				return (EXIT_FAILURE);
+			}
+
+			break;
+
+		case 'i':
+			interval = strtol(optarg, &endptr, 0);
+			if (*optarg == '\0' || *endptr != '\0' || interval <= 0) {
+				fprintf(stderr, "A positive checkpoint interval is expected\n");
+				return (EXIT_FAILURE);
+			}
+
+			if (interval > UINT_MAX)
+				interval = UINT_MAX;
+
+			break;
+
 		case 'j':
 			threads = strtol(optarg, &endptr, 0);
 			if (*optarg == '\0' || *endptr != '\0' || threads <= 0) {
@@ -57,6 +118,64 @@ main(int argc, char *argv[])
 
 			break;
 
+		case 'm':
+			flags = parse_tablebase_memory(optarg);
+			if (flags == -1) {
+				fprintf(stderr, "Invalid memory options %s\n", optarg);
+				return (EXIT_FAILURE);
+			}
+
+			break;
+
+		case 'p':
+			opts.pin = 1;
+			break;
+
+		case 'r':
+			opts.resume = optarg;
+			break;
+
+		case 't':
+			if (opts.telemetry != NULL)
+				fclose(opts.telemetry);
+
+			opts.telemetry = fopen(optarg, "w");
+			if (opts.telemetry == NULL) {
+				perror(optarg);
+				return (EXIT_FAILURE);
+			}
+
+			break;
+
+		case 'w':
+			if (wdlfile != NULL)
+				fclose(wdlfile);
+
+			wdlfile = fopen(optarg, "wb");
+			if (wdlfile == NULL) {
+				perror(optarg);
+				return (EXIT_FAILURE);
+			}
+
+			break;
+
+		case 'x':
+			predict = 1;
+			break;
+
+		case 'z':
+			if (optarg[0] < '0' || optarg[0] > '9'
+			    || (optarg[1] != '\0' && strcmp(optarg + 1, "e") != 0)) {
+				fprintf(stderr, "Invalid xz preset %s, expected 0 to 9, optionally followed by e\n", optarg);
+				return (EXIT_FAILURE);
+			}
+
+			opts.compression = optarg[0] - '0';
+			if (optarg[1] == 'e')
+				opts.compression |= TB_XZ_EXTREME;
+
+			break;
+
 		case '?':
 		default:
 			goto usage;
@@ -65,24 +184,47 @@ main(int argc, char *argv[])
 
 	if (argc - optind != 1) {
 	usage:
-		fprintf(stderr, "Usage: %s [-j nproc] dobutsu.tb\n", argv[0]);
+		fprintf(stderr, "Usage: %s [-b blocksize] [-c checkpoint] [-e engine] [-i interval] [-j nproc] [-m memory]\n"
+		    "       [-p] [-r checkpoint] [-t telemetry] [-w bitbase] [-x] [-z preset] dobutsu.tb\n", argv[0]);
 		return (EXIT_FAILURE);
 	}
 
+	if (predict) {
+		if (opts.compression == TB_UNCOMPRESSED) {
+			fprintf(stderr, "Option -x requires -z\n");
+			return (EXIT_FAILURE);
+		}
+
+		opts.compression |= TB_XZ_PREDICT;
+	}
+
 	tbfile = fopen(argv[optind], "wb");
 	if (tbfile == NULL) {
 		perror("fopen");
 		return (EXIT_FAILURE);
 	}
 
-	tb = generate_tablebase(threads);
+	/* the threads fault in their parts of the table themselves */
+	if (opts.pin)
+		flags &= ~TBMEM_PREFAULT;
+
+	set_tablebase_memory(flags);
+	opts.threads = threads;
+	opts.checkpoint_interval = interval;
+	opts.output = tbfile;
+	tb = generate_tablebase(&opts);
 	if (tb == NULL) {
 		perror("generate_tablebase");
 		return (EXIT_FAILURE);
 	}
 
-	if (write_tablebase(tbfile, tb)) {
-		perror("write_tablebase");
+	if (wdlfile != NULL && (write_bitbase(wdlfile, tb) != 0 || fclose(wdlfile) != 0)) {
+		perror("write_bitbase");
+		return (EXIT_FAILURE);
+	}
+
+	if (opts.telemetry != NULL && fclose(opts.telemetry) != 0) {
+		perror("telemetry");
 		return (EXIT_FAILURE);
 	}
 
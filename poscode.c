@@ -23,16 +23,19 @@
  * SUCH DAMAGE.
  */
 #include <assert.h>
+#include <stdint.h>
 
 #include "dobutsutable.h"
 
 static void	mirror_board(struct position *);
 static void	turn_board(struct position *);
 static void	normalize_position(struct position *);
+static int	mirror_is_smaller(const struct position *);
 static unsigned	encode_ownership(const struct position *);
 static void	encode_pieces(poscode *, struct position *);
 static void	place_pieces(struct position *, unsigned, unsigned, unsigned);
 static void	assign_ownership(struct position *, unsigned);
+static int	is_symmetric(unsigned);
 
 /*
  * Encode a position structure into a tablebase index (poscode).  It is
@@ -50,6 +53,28 @@ encode_position(poscode *pc, const struct position *pos)
 	assert(has_valid_ownership(*pc));
 }
 
+/*
+ * Return 1 if pc is the poscode encode_position() yields for the
+ * position it decodes to, 0 otherwise.  Only positions with both lions
+ * on the B file have a second poscode, the one of their mirror image
+ * (see normalize_position()).  The entries of these poscodes are never
+ * looked up.
+ */
+extern int
+is_canonical(poscode pc)
+{
+	struct position p;
+	poscode canon;
+
+	if (!is_symmetric(pc.lionpos))
+		return (1);
+
+	decode_poscode(&p, pc);
+	encode_position(&canon, &p);
+
+	return (canon.ownership == pc.ownership && canon.cohort == pc.cohort
+	    && canon.map == pc.map);
+}
 
 /*
  * Decode a tablebase index (poscode) into a position structure.  It is
@@ -162,6 +187,9 @@ turn_board(struct position *p)
  *  - if it's Gote to move, turn the board 180 degrees.
  *  - if the Sente lion is on the right board-half, flip the board
  *    along the center file
+ *  - if both lions are on the center file, flip the board if that
+ *    yields the smaller board (see mirror_is_smaller()), so a position
+ *    and its mirror image normalize to the same board.
  */
 static void
 normalize_position(struct position *p)
@@ -173,6 +201,37 @@ normalize_position(struct position *p)
 	if (piece_in(00444, p->pieces[LION_S])
 	    || (piece_in(02222, p->pieces[LION_S]) && piece_in(01111 << GOTE_PIECE, p->pieces[LION_G])))
 		mirror_board(p);
+	else if (piece_in(02222, p->pieces[LION_S])
+	    && piece_in(02222 << GOTE_PIECE, p->pieces[LION_G])
+	    && mirror_is_smaller(p))
+		mirror_board(p);
+}
+
+/*
+ * Describe the non-lion pieces on the board of p with a number holding
+ * 4 bits per square, the kind, owner and promotion status of the piece
+ * on it or 0 if the square is empty.  Return 1 if this number is
+ * smaller for the mirror image of p than for p, 0 otherwise.  Pieces
+ * in hand and the lions on the B file are the same for both, and pieces
+ * of the same kind yield the same number regardless of their order.
+ */
+static int
+mirror_is_smaller(const struct position *p)
+{
+	uint_least64_t board = 0, mirrored = 0, piece;
+	unsigned i, sq;
+
+	for (i = 0; i < LION_S; i++) {
+		sq = p->pieces[i] & ~GOTE_PIECE;
+		if (sq == IN_HAND)
+			continue;
+
+		piece = 1 + 4 * (i / 2) + 2 * gote_owns(p->pieces[i]) + is_promoted(i, p);
+		board |= piece << 4 * sq;
+		mirrored |= piece << 4 * (sq + 2 - 2 * (sq % 3));
+	}
+
+	return (mirrored < board);
 }
 
 /*
@@ -496,6 +555,53 @@ const unsigned char ownership_map[OWNERSHIP_TOTAL_COUNT] = {
 	41, 57, 58, 59, 60, 61, 62, 63,
 };
 
+/*
+ * The inverse permutation of ownership_map, used by offset_poscode().
+ */
+static const unsigned char ownership_inverse[OWNERSHIP_TOTAL_COUNT] = {
+	 0,  1,  2,  3,  4,  5,  6,  7,
+	 8,  9, 10, 11, 12, 13, 14, 16,
+	17, 18, 19, 20, 21, 22, 24, 25,
+	26, 28, 32, 33, 34, 35, 36, 37,
+	38, 40, 41, 42, 44, 48, 49, 50,
+	52, 56, 15, 23, 27, 29, 30, 31,
+	39, 43, 45, 46, 47, 51, 53, 54,
+	55, 57, 58, 59, 60, 61, 62, 63,
+};
+
+/*
+ * Compute the poscode corresponding to an offset into the tablebase.
+ * This is the inverse of position_offset().  It is assumed that offset
+ * is less than POSITION_TOTAL_COUNT.
+ */
+extern poscode
+offset_poscode(size_t offset)
+{
+	poscode pc;
+	unsigned rem, lo = 0, hi = COHORT_COUNT, mid;
+
+	assert(offset < POSITION_TOTAL_COUNT);
+
+	pc.ownership = ownership_inverse[offset / (POSITION_TOTAL_COUNT / OWNERSHIP_TOTAL_COUNT)];
+	rem = offset % (POSITION_TOTAL_COUNT / OWNERSHIP_TOTAL_COUNT);
+
+	/* find the last cohort beginning at or before rem */
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (cohort_size[mid].offset <= rem)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	pc.cohort = lo;
+	rem -= cohort_size[lo].offset;
+	pc.lionpos = rem / cohort_size[lo].size;
+	pc.map = rem % cohort_size[lo].size;
+
+	return (pc);
+}
+
 /*
  * The sente lion has five squares to be on: If the lion is on A, he has
  * already won, so this can't happen.  If he's on B, we can mirror the
@@ -833,27 +939,13 @@ place_pieces(struct position *p, unsigned cohort, unsigned lionpos, unsigned map
 }
 
 /*
- * If the position p can be mirrored such that the result has a
- * different poscode than the original, mirror p and return nonzero.
- * Otherwise return 0 and leave p unchaged.  This function does not
- * update p->map, its intent is to allow for the generation of both
- * poscodes of a given position for generating the table base.  It
- * should not be used for other purposes.
+ * Return 1 if both lions are on the B file in lionpos, 0 otherwise.
+ * Mirroring the board does not change lionpos then.
  */
-extern int
-position_mirror(struct position *p)
+static int
+is_symmetric(unsigned lionpos)
 {
 
-	/*
-	 * We only check if both lions are on the B file.  This is
-	 * not as precise as possible, but the gain of doing less
-	 * checks for every position probably offsets the loss of
-	 * encoding a few more positions than necessary.
-	 */
-	if (piece_in(02222, p->pieces[LION_S])
-	    && piece_in(02222 << GOTE_PIECE, p->pieces[LION_G])) {
-		mirror_board(p);
-		return (1);
-	} else
-		return (0);
+	return (lionpos_inverse[lionpos][0] % 3 == 1
+	    && lionpos_inverse[lionpos][1] % 3 == 1);
 }
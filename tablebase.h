@@ -33,6 +33,7 @@
  */
 
 #include <stdio.h>
+#include <sys/types.h>
 
 #include "rules.h"
 
@@ -77,6 +78,47 @@ struct seed {
 	unsigned short xsubi[3];
 };
 
+/*
+ * This structure describes the outcome of sample_tablebase().  samples
+ * positions were checked of which errors were found to be wrong.  The
+ * samples were drawn from strata strata.  rate is an estimate for the
+ * fraction of wrong positions in the tablebase, upper an upper bound
+ * for it at the confidence level requested.
+ */
+struct sample_result {
+	size_t samples, errors, strata;
+	double rate, upper;
+};
+
+/*
+ * This structure controls how generate_tablebase() operates.  threads
+ * is the number of threads to use, engine is one of the GENTB_ENGINE_*
+ * constants and selects the algorithm used to find lost positions.
+ * If checkpoint is not NULL, the generator state is saved to the file
+ * checkpoint every checkpoint_interval rounds.  If resume is not NULL,
+ * generation continues from the checkpoint stored in the file resume.
+ * If pin is nonzero, threads are pinned to CPUs, the table is placed on
+ * the NUMA nodes of the threads working on it, and the throughput of
+ * each node is reported.  If telemetry is not NULL, a JSON record
+ * with statistics is written to it for every round and thread and a
+ * histogram of the distance to mate of each cohort after generation.
+ * If output is not NULL, the table base is written to output as with
+ * write_tablebase() with the given compression and block_size while
+ * the last pass over the table is still running.
+ */
+struct gentb_options {
+	int threads;
+	int engine;
+	int pin;
+	const char *checkpoint;
+	unsigned checkpoint_interval;
+	const char *resume;
+	FILE *telemetry;
+	FILE *output;
+	int compression;
+	size_t block_size;
+};
+
 enum {
 	/*
 	 * The maximum number of threads allowed for generate_tablebase.
@@ -90,6 +132,52 @@ enum {
 	GENTB_MAX_THREADS = 64,
 #endif
 
+	/*
+	 * Engines for generate_tablebase().  GENTB_ENGINE_VERIFY checks
+	 * all moves of a candidate position to find out if it is lost.
+	 * GENTB_ENGINE_COUNT instead keeps track of how many moves of
+	 * each position do not lead to a position known to be won for
+	 * the opponent, at the cost of one extra byte per position.
+	 * Both engines generate the same tablebase.
+	 */
+	GENTB_ENGINE_VERIFY = 0,
+	GENTB_ENGINE_COUNT = 1,
+
+	/*
+	 * Flags for set_tablebase_memory() controlling how the memory
+	 * for tablebases is allocated.  TBMEM_HUGE_2M and TBMEM_HUGE_1G
+	 * request huge pages of the given size, TBMEM_THP requests
+	 * transparent huge pages.  If the requested kind of page is not
+	 * available, smaller pages are used instead.  TBMEM_PREFAULT
+	 * faults in all pages right away and TBMEM_LOCK locks them into
+	 * memory, so the first probes do not stall.  TBMEM_SHARED makes
+	 * read_tablebase() decompress compressed tablebases into shared
+	 * memory once for all processes loading the same file.
+	 * TBMEM_PACKED makes read_tablebase() pack the tablebase into
+	 * about 80% of the memory, at the expense of slower lookups.
+	 */
+	TBMEM_DEFAULT = 0,
+	TBMEM_HUGE_2M = 1 << 0,
+	TBMEM_HUGE_1G = 1 << 1,
+	TBMEM_THP = 1 << 2,
+	TBMEM_PREFAULT = 1 << 3,
+	TBMEM_LOCK = 1 << 4,
+	TBMEM_SHARED = 1 << 5,
+	TBMEM_PACKED = 1 << 6,
+
+	/*
+	 * Values for the compression argument of write_tablebase().
+	 * TB_UNCOMPRESSED writes the raw table base.  Otherwise, the
+	 * table base is compressed with xz using the preset level given
+	 * (0 to 9), optionally or'ed with TB_XZ_EXTREME for the extreme
+	 * variant of the preset (like xz -e) and with TB_XZ_PREDICT to
+	 * store the live bitmap predicted from similar ownership classes,
+	 * which makes the file smaller.
+	 */
+	TB_UNCOMPRESSED = -1,
+	TB_XZ_EXTREME = 1 << 8,
+	TB_XZ_PREDICT = 1 << 9,
+
 	/*
 	 * The last parameter to ai_move() indicates the ai strength,
 	 * which should be an integer between 0 and MAX_STRENGTH.  This
@@ -100,18 +188,33 @@ enum {
 };
 
 /* tablebase functionality */
-extern		struct tablebase	*generate_tablebase(int);
+extern		struct tablebase	*generate_tablebase(const struct gentb_options*);
 extern		struct tablebase	*read_tablebase(FILE*);
-extern		tb_entry		 lookup_position(const struct tablebase*, const struct position*);
-extern		int			 write_tablebase(FILE*, const struct tablebase*);
-extern		int			 validate_tablebase(const struct tablebase*);
+extern		int			 lookup_position(const struct tablebase*, const struct position*,
+					     tb_entry*);
+extern		int			 lookup_positions(const struct tablebase*, const struct position*,
+					     size_t, tb_entry*);
+extern		int			 lookup_successors(const struct tablebase*, const struct position*,
+					     size_t, tb_entry*);
+extern		int			 write_tablebase(FILE*, const struct tablebase*, int, size_t, int);
+extern		int			 write_bitbase(FILE*, const struct tablebase*);
+extern		int			 validate_tablebase(const struct tablebase*, int);
+extern		int			 sample_tablebase(struct sample_result*, const struct tablebase*,
+					     size_t, unsigned long, double);
 extern		void			 free_tablebase(struct tablebase*);
+extern		int			 parse_tablebase_memory(const char*);
+extern		int			 parse_size(const char*, size_t*);
+extern		void			 set_tablebase_memory(int);
+extern		void			 set_tablebase_decoder(unsigned, unsigned long long);
+extern		void			 set_tablebase_cache(size_t);
+extern		void			 set_tablebase_cachedir(const char*);
+extern		void			 get_tablebase_progress(size_t*, size_t*);
 
 /* ai functionality */
 extern		void			 ai_seed(struct seed*);
-extern		struct move		 ai_move(const struct tablebase*, const struct position*,
-					     struct seed*, double);
-extern		size_t			 analyze_position(struct analysis[MAX_MOVES],
+extern		int			 ai_move(struct move*, const struct tablebase*,
+					     const struct position*, struct seed*, double);
+extern		ssize_t			 analyze_position(struct analysis[MAX_MOVES],
 					     const struct tablebase*, const struct position*, double);
 
 /* auxillary functionality */
@@ -24,49 +24,255 @@
  */
 #define _POSIX_C_SOURCE 200809L
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <lzma.h>
 
 #include "dobutsutable.h"
 
-static int read_xz_tablebase(FILE *f, struct tablebase *tb);
+static struct tablebase *load_tablebase(FILE *f);
+static struct tablebase *find_tablebase(FILE *f);
+static int read_xz_tablebase(FILE *f, struct tablebase *tb, int xz);
+static int read_raw_tablebase(FILE *f, struct tablebase *tb);
+static int check_raw(int fd, off_t startpos);
+static int is_xz(FILE *f);
+static int read_entries(const struct tablebase *tb, const size_t *offsets, size_t n, tb_entry *out);
+static size_t probe_offset(const struct position *p);
+static int derived_entry(const struct tablebase *tb, const struct position *p, tb_entry *out);
+static void prefetch_slot(const struct tablebase *tb, size_t slot);
+static size_t entry_offset(const struct tablebase *tb, size_t slot);
+static void prefetch_entry(const struct tablebase *tb, size_t offset);
+static int decode_xz(FILE *f, struct tablebase *tb);
 
 /*
- * Release all storage associated with tb.  The pointer to tb then
- * becomes invalid.
+ * The number of threads and the memory limit for decompressing xz
+ * compressed tablebases, see set_tablebase_decoder().
+ */
+static unsigned xz_threads = 0;
+static unsigned long long xz_memlimit = 0;
+
+/*
+ * The directory to keep decompressed copies of compressed tablebases
+ * in, see set_tablebase_cachedir().
+ */
+static const char *tb_cachedir = NULL;
+
+/*
+ * The number of bytes the current call to read_tablebase() has loaded
+ * so far and the number of bytes it loads in total, which is less for
+ * a bitbase, see get_tablebase_progress().
+ */
+static atomic_ullong tb_progress = 0;
+static atomic_ullong tb_total = TB_DATA_SIZE;
+
+/*
+ * Set the number of threads used to decompress xz compressed tablebases
+ * to threads and limit the amount of memory the decoder may use for
+ * decompressing in parallel to memlimit bytes.  If decompressing with
+ * the given number of threads would need more memory, fewer threads are
+ * used.  If threads is 0, one thread per processor is used.  If
+ * memlimit is 0, the limit is a quarter of the physical memory.
  */
 extern void
-free_tablebase(struct tablebase *tb)
+set_tablebase_decoder(unsigned threads, unsigned long long memlimit)
 {
-	free(tb);
+
+	xz_threads = threads;
+	xz_memlimit = memlimit;
 }
 
 /*
- * Looks up a position in the table base, return its value.
+ * Keep decompressed copies of compressed tablebases in directory dir,
+ * so later calls to read_tablebase() can map them instead of
+ * decompressing the tablebase again.  The directory must exist.  If
+ * dir is NULL, no copies are kept.  dir is not copied and must remain
+ * valid.
  */
-extern tb_entry
-lookup_position(const struct tablebase *tb, const struct position *p)
+extern void
+set_tablebase_cachedir(const char *dir)
 {
-	poscode pc, ppc;
-	struct move moves[MAX_MOVES];
-	struct position pp;
-	size_t i, nmove;
-	tb_entry e, worst = 1;
-	int game_ends;
 
-	/* checkmates aren't looked up */
+	tb_cachedir = dir;
+}
+
+/*
+ * Store in done how many of the total bytes of the tablebase
+ * read_tablebase() has loaded so far.  This may be called from another
+ * thread while read_tablebase() is running.  Once it returned, done is
+ * total if the tablebase was loaded.
+ */
+extern void
+get_tablebase_progress(size_t *done, size_t *total)
+{
+
+	*done = atomic_load(&tb_progress);
+	*total = atomic_load(&tb_total);
+}
+
+/*
+ * Prefetch the cache line holding addr if the compiler lets us.
+ */
+#ifdef __GNUC__
+# define prefetch(addr) __builtin_prefetch((const void *)(addr))
+#else
+# define prefetch(addr) ((void)(addr))
+#endif
+
+/*
+ * The number of positions lookup_positions() encodes and prefetches
+ * before reading their entries.
+ */
+enum {
+	LOOKUP_BATCH = 64,
+};
+
+/*
+ * Special offsets returned by probe_offset() for positions that are
+ * not looked up directly.
+ */
+#define PROBE_CHECKMATE ((size_t)-1)
+#define PROBE_DERIVED ((size_t)-2)
+
+/*
+ * Looks up a position in the table base and stores its value in e.
+ * Return 0 on success or -1 with errno set if the entry could not be
+ * read (see lookup_positions()).
+ */
+extern int
+lookup_position(const struct tablebase *tb, const struct position *p, tb_entry *e)
+{
+
+	return (lookup_positions(tb, p, 1, e));
+}
+
+/*
+ * Like lookup_positions(), but the n positions in positions are the
+ * successors of one position, for which the best move is to be found.
+ * For a bitbase, if some of the positions are lost but none of them
+ * is known to be lost within BITBASE_DEPTH moves, the search goes on
+ * until the shortest loss among them is found (see bitbase_entries()).
+ * Return 0 on success or -1 with errno set like lookup_positions().
+ */
+extern int
+lookup_successors(const struct tablebase *tb, const struct position *positions,
+    size_t n, tb_entry *out)
+{
+
+	if (!tb->wdl)
+		return (lookup_positions(tb, positions, n, out));
+
+	bitbase_entries(tb, positions, n, out, 1);
+
+	return (0);
+}
+
+/*
+ * Look up the n positions in positions and store their values in out.
+ * The positions are encoded and the parts of the live bitmap telling
+ * where their entries are prefetched in batches, then their entries
+ * are located and prefetched before any entry is read, so the cache
+ * and TLB misses of the batch overlap instead of happening one after
+ * another.  Return 0 on success.  If the table base is decompressed
+ * lazily and a block holding one of the entries cannot be read or is
+ * damaged, return -1 with errno set; the values in out are undefined
+ * then.
+ */
+extern int
+lookup_positions(const struct tablebase *tb, const struct position *positions,
+    size_t n, tb_entry *out)
+{
+	size_t i, base, count, ntable, offsets[LOOKUP_BATCH], index[LOOKUP_BATCH];
+	tb_entry entries[LOOKUP_BATCH];
+
+	if (tb->wdl) {
+		bitbase_entries(tb, positions, n, out, 0);
+		return (0);
+	}
+
+	for (base = 0; base < n; base += count) {
+		count = n - base < LOOKUP_BATCH ? n - base : LOOKUP_BATCH;
+
+		for (i = 0; i < count; i++) {
+			offsets[i] = probe_offset(positions + base + i);
+			if (offsets[i] < POSITION_COUNT)
+				prefetch_slot(tb, offsets[i]);
+		}
+
+		for (i = 0; i < count; i++)
+			if (offsets[i] < POSITION_COUNT) {
+				offsets[i] = entry_offset(tb, offsets[i]);
+				prefetch_entry(tb, offsets[i]);
+			}
+
+		/* the entries in the table base are read all at once */
+		ntable = 0;
+		for (i = 0; i < count; i++)
+			switch (offsets[i]) {
+			case PROBE_CHECKMATE:
+				out[base + i] = 1;
+				break;
+
+			case PROBE_DERIVED:
+				if (derived_entry(tb, positions + base + i, out + base + i) != 0)
+					return (-1);
+
+				break;
+
+			default:
+				index[ntable] = base + i;
+				offsets[ntable++] = offsets[i];
+			}
+
+		if (read_entries(tb, offsets, ntable, entries) != 0)
+			return (-1);
+
+		for (i = 0; i < ntable; i++)
+			out[index[i]] = entries[i];
+	}
+
+	return (0);
+}
+
+/*
+ * Return the slot of p in the table base, or PROBE_CHECKMATE if p is a
+ * checkmate, which isn't looked up, or PROBE_DERIVED if p is not in
+ * the table base and its value must be derived from its successors.
+ */
+static size_t
+probe_offset(const struct position *p)
+{
+	poscode pc;
+
 	if (gote_moves(p) ? sente_in_check(p) : gote_in_check(p))
-		return (1);
+		return (PROBE_CHECKMATE);
 
 	encode_position(&pc, p);
+	if (ownership_map[pc.ownership] >= OWNERSHIP_COUNT)
+		return (PROBE_DERIVED);
 
-	/* if the position is in the table base, look it up */
-	if (ownership_map[pc.ownership] < OWNERSHIP_COUNT)
-		return (tb->positions[position_offset(pc)]);
+	return (position_offset(pc));
+}
+
+/*
+ * Compute the value of p, a position not in the table base, from the
+ * values of its successors, all of which are in the table base, and
+ * store it in out.  The entries of the successors are located and
+ * prefetched before they are read.  Return 0 on success or -1 with
+ * errno set if they could not be read.
+ */
+static int
+derived_entry(const struct tablebase *tb, const struct position *p, tb_entry *out)
+{
+	poscode pc;
+	struct move moves[MAX_MOVES];
+	struct position pp;
+	size_t i, nmove, n = 0, offsets[MAX_MOVES];
+	tb_entry entries[MAX_MOVES], worst = 1;
+	int game_ends;
 
-	/* otherwise, compute its value */
 	nmove = generate_moves(moves, p);
 	for (i = 0; i < nmove; i++) {
 		pp = *p;
@@ -78,14 +284,93 @@ lookup_position(const struct tablebase *tb, const struct position *p)
 		if (gote_moves(&pp) ? sente_in_check(&pp) : gote_in_check(&pp))
 			continue;
 
-		encode_position(&ppc, &pp);
-		assert(ownership_map[ppc.ownership] < OWNERSHIP_COUNT);
-		e = tb->positions[position_offset(ppc)];
-		if (wdl_compare(e, worst) < 0)
-			worst = e;
+		encode_position(&pc, &pp);
+		assert(ownership_map[pc.ownership] < OWNERSHIP_COUNT);
+		offsets[n] = position_offset(pc);
+		prefetch_slot(tb, offsets[n++]);
+	}
+
+	for (i = 0; i < n; i++) {
+		offsets[i] = entry_offset(tb, offsets[i]);
+		prefetch_entry(tb, offsets[i]);
 	}
 
-	return (prev_dtm(worst));
+	if (read_entries(tb, offsets, n, entries) != 0)
+		return (-1);
+
+	for (i = 0; i < n; i++)
+		if (wdl_compare(entries[i], worst) < 0)
+			worst = entries[i];
+
+	*out = prev_dtm(worst);
+
+	return (0);
+}
+
+/*
+ * Prefetch the part of the live bitmap of tb and its rank needed to
+ * find the entry of the position in slot.
+ */
+static void
+prefetch_slot(const struct tablebase *tb, size_t slot)
+{
+
+	if (tb->live.ranks != NULL) {
+		prefetch(tb->live.ranks + slot / LIVE_BLOCK);
+		prefetch(tb->live.bits + slot / 64 * 8);
+	} else
+		prefetch_entry(tb, slot);
+}
+
+/*
+ * Return the offset of the entry of the position in slot in tb.  Only
+ * the tablebase being generated has an entry for every slot.
+ */
+static size_t
+entry_offset(const struct tablebase *tb, size_t slot)
+{
+
+	if (tb->live.ranks == NULL)
+		return (slot);
+
+	assert(tb->live.bits[slot / 8] & 1 << slot % 8);
+
+	return (live_rank(&tb->live, slot));
+}
+
+/*
+ * Prefetch the entry at offset in tb unless tb is decompressed lazily.
+ */
+static void
+prefetch_entry(const struct tablebase *tb, size_t offset)
+{
+
+	if (tb->positions != NULL)
+		prefetch(tb->positions + offset);
+	else if (tb->pack != NULL)
+		prefetch(tb->pack->codes + offset / 2);
+}
+
+/*
+ * Store the n entries at offsets in tb in out, decompressing them
+ * first if tb is decompressed lazily.  Return 0 on success or -1 with
+ * errno set if they could not be decompressed.
+ */
+static int
+read_entries(const struct tablebase *tb, const size_t *offsets, size_t n, tb_entry *out)
+{
+	size_t i;
+
+	if (tb->cache != NULL)
+		return (cached_entries(tb->cache, offsets, n, out));
+
+	for (i = 0; i < n; i++)
+		if (tb->pack != NULL)
+			out[i] = packed_entry(tb->pack, offsets[i]);
+		else
+			out[i] = tb->positions[offsets[i]];
+
+	return (0);
 }
 
 /*
@@ -93,23 +378,131 @@ lookup_position(const struct tablebase *tb, const struct position *p)
  * in binary mode for reading.  This function returns a pointer to the
  * newly loaded tablebase on success or NULL on error with errno
  * indicating the reason for failure.  Both uncompressed and compressed
- * table bases are supported, the code first tries to decompress the
- * table base, if it turns out to be uncompressed, another attempt is
- * made at reading an uncompressed tablebase.
+ * table bases are supported, as well as win/draw/loss bitbases (see
+ * read_bitbase()) for which distances to mate are searched on lookup.
+ * The header of the table base is checked first, so files of another
+ * format or layout are rejected with EINVAL right away.  Uncompressed
+ * table bases are mapped into memory if possible, so loading them
+ * takes constant time.  Compressed table bases are decompressed
+ * lazily if set_tablebase_cache() was used to configure a cache and
+ * the file is made of small enough blocks.  With TBMEM_SHARED, they
+ * are decompressed into shared memory once for all processes.  If
+ * set_tablebase_cachedir() was used to configure a cache directory,
+ * they are decompressed into a file in that directory once and mapped
+ * from there.  Otherwise the code first tries to decompress the table
+ * base, if it turns out to be uncompressed, another attempt is made at
+ * reading an uncompressed tablebase.  Progress can be watched with
+ * get_tablebase_progress().  With TBMEM_PACKED, the table base is
+ * packed once it has been loaded unless it is decompressed lazily.
  */
 extern struct tablebase *
 read_tablebase(FILE *f)
 {
-	struct tablebase *tb = malloc(sizeof *tb);
-	off_t startpos;
+	struct tablebase *tb;
+	int error;
 
-	if (tb == NULL)
+	atomic_store(&tb_progress, 0);
+	atomic_store(&tb_total, TB_DATA_SIZE);
+	tb = load_tablebase(f);
+	if (tb != NULL && tb->positions != NULL && !tb->wdl && get_tablebase_memory() & TBMEM_PACKED
+	    && pack_tablebase(tb) != 0) {
+		error = errno;
+		free_tablebase(tb);
+		errno = error;
 		return (NULL);
+	}
+
+	if (tb != NULL)
+		atomic_store(&tb_progress, atomic_load(&tb_total));
+
+	return (tb);
+}
+
+/*
+ * Do the work for read_tablebase(), then index the live bitmap of the
+ * table base unless that has been done already.
+ */
+static struct tablebase *
+load_tablebase(FILE *f)
+{
+	struct tablebase *tb;
+	int error;
+
+	tb = find_tablebase(f);
+	if (tb == NULL || tb->wdl || tb->live.ranks != NULL)
+		return (tb);
+
+	if (index_live(&tb->live, (const unsigned char *)tb->positions + TB_LIVE_OFFSET) != 0) {
+		error = errno;
+		free_tablebase(tb);
+		errno = error;
+		return (NULL);
+	}
+
+	return (tb);
+}
+
+/*
+ * Load the table base in f in whatever way is most suitable for it.
+ */
+static struct tablebase *
+find_tablebase(FILE *f)
+{
+	struct tablebase *tb;
+	off_t startpos;
+	int xz, raw;
 
 	if (startpos = ftello(f), startpos == -1)
-		goto cleanup;
+		return (NULL);
+
+	xz = is_xz(f);
+	if (xz)
+		tb = open_cached_tablebase(f);
+	else if (raw = check_raw(fileno(f), startpos), raw == -1) {
+		/* the header and index could not be validated */
+		if (errno != EINVAL)
+			return (NULL);
+
+		/* not a tablebase, but maybe a bitbase */
+		if (fseeko(f, startpos, SEEK_SET) == -1)
+			return (NULL);
+
+		atomic_store(&tb_total, TB_HEADER_SIZE + WDL_SIZE);
+
+		return (read_bitbase(f));
+	} else if (raw == 1)
+		/* the live bitmap must be restored, so it is read below */
+		tb = NULL;
+	else
+		tb = map_tablebase(fileno(f), startpos + TB_HEADER_SIZE, TB_DATA_SIZE);
+
+	if (tb != NULL)
+		return (tb);
+
+	if (fseeko(f, startpos, SEEK_SET) == -1)
+		return (NULL);
+
+	if (xz && get_tablebase_memory() & TBMEM_SHARED) {
+		tb = share_tablebase(f, decode_xz);
+		if (tb != NULL)
+			return (tb);
+
+		if (fseeko(f, startpos, SEEK_SET) == -1)
+			return (NULL);
+	} else if (xz && tb_cachedir != NULL) {
+		tb = cache_tablebase(f, tb_cachedir, decode_xz);
+		if (tb != NULL)
+			return (tb);
+
+		if (fseeko(f, startpos, SEEK_SET) == -1)
+			return (NULL);
+	}
+
+	tb = alloc_tablebase(TB_DATA_SIZE);
+	if (tb == NULL)
+		return (NULL);
 
-	switch (read_xz_tablebase(f, tb)) {
+	switch (read_xz_tablebase(f, tb, xz)) {
 	case 0:
 		return (tb);
 
@@ -120,7 +513,7 @@ read_tablebase(FILE *f)
 		if (fseeko(f, startpos, SEEK_SET) == -1)
 			goto cleanup;
 
-		if (fread((void*)tb->positions, sizeof tb->positions, 1, f) != 1)
+		if (read_raw_tablebase(f, tb) != 0)
 			goto cleanup;
 
 		return (tb);
@@ -130,25 +523,152 @@ read_tablebase(FILE *f)
 	}
 
 cleanup:
-	free(tb);
+	free_tablebase(tb);
 	return NULL;
 }
 
+/*
+ * Decompress the xz compressed tablebase in f into tb for
+ * share_tablebase() and cache_tablebase().  Return 0 on success, -1
+ * on error with errno set.
+ */
+static int
+decode_xz(FILE *f, struct tablebase *tb)
+{
+
+	errno = 0;
+	if (read_xz_tablebase(f, tb, 1) == 0)
+		return (0);
+
+	if (errno == 0)
+		errno = EINVAL;
+
+	return (-1);
+}
+
+/*
+ * Check the header and the index of the uncompressed tablebase found
+ * at startpos in file descriptor fd without reading the positions.
+ * Return 0 if they are valid, 1 if they are valid but the live bitmap
+ * is stored predicted from reference sections, so the table cannot be
+ * mapped as is, -1 with errno set to EINVAL if they are not valid, or
+ * -1 with some other errno value if they cannot be read.
+ */
+static int
+check_raw(int fd, off_t startpos)
+{
+	uint64_t crc[OWNERSHIP_COUNT + 1];
+	size_t i;
+	unsigned ref[OWNERSHIP_COUNT];
+	unsigned char header[TB_HEADER_LEN], index[TB_INDEX_SIZE];
+	ssize_t count;
+
+	count = pread(fd, header, sizeof header, startpos);
+	if (count == -1)
+		return (-1);
+
+	if (count != sizeof header || check_tbheader(header) != 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	count = pread(fd, index, sizeof index, startpos + TB_HEADER_SIZE + TB_DATA_SIZE);
+	if (count == -1)
+		return (-1);
+
+	if (count != sizeof index || check_tbindex(index, crc, ref) != 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	for (i = 0; i < OWNERSHIP_COUNT; i++)
+		if (ref[i] != i)
+			return (1);
+
+	return (0);
+}
+
+/*
+ * Read an uncompressed tablebase from f into tb, checking its header,
+ * index, and checksums.  Return 0 on success, -1 on error with errno
+ * set.
+ */
+static int
+read_raw_tablebase(FILE *f, struct tablebase *tb)
+{
+	uint64_t crc[OWNERSHIP_COUNT + 1];
+	unsigned ref[OWNERSHIP_COUNT];
+	unsigned char index[TB_INDEX_SIZE];
+
+	/* the header is read into the table, it is overwritten later */
+	errno = EINVAL;
+	if (fread((void*)tb->positions, TB_HEADER_SIZE, 1, f) != 1
+	    || check_tbheader((unsigned char *)tb->positions) != 0)
+		return (-1);
+
+	errno = EINVAL;
+	if (fread((void*)tb->positions, TB_DATA_SIZE, 1, f) != 1
+	    || fread(index, sizeof index, 1, f) != 1
+	    || check_tbindex(index, crc, ref) != 0)
+		return (-1);
+
+	return (verify_sections(tb, crc, ref));
+}
+
+/*
+ * Check if f starts with the magic number of an xz file.  The file
+ * position is advanced in the process.
+ */
+static int
+is_xz(FILE *f)
+{
+	static const unsigned char magic[6] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+	unsigned char buf[sizeof magic];
+
+	return (fread(buf, sizeof buf, 1, f) == 1 && memcmp(buf, magic, sizeof magic) == 0);
+}
+
 /*
  * Read an xz compressed endgame tablebase.  Return 0 on success, 1 on
  * failure where the file could not possibly be an uncompressed
  * tablebase and 2 on failure where the file could be an uncompressed
  * tablebase.  In case of error, the tablebase contents are undefined.
+ * If xz is set, f is known to be an xz file and the multi-threaded
+ * decoder is used.  It decompresses the blocks of files written by
+ * gentb in parallel and falls back to decompressing in a single
+ * thread for files made of a single block.  The header is decompressed
+ * into the table and checked before the positions are decompressed,
+ * the checksums in the index are checked once the whole file has been
+ * decompressed.
  */
 static int
-read_xz_tablebase(FILE *f, struct tablebase *tb)
+read_xz_tablebase(FILE *f, struct tablebase *tb, int xz)
 {
 	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_mt mt;
+	lzma_action action = LZMA_RUN;
 	size_t count;
-	int error;
-	char inbuf[BUFSIZ];
+	uint64_t crc[OWNERSHIP_COUNT + 1];
+	unsigned ref[OWNERSHIP_COUNT];
+	int error = LZMA_OPTIONS_ERROR, part = 0;
+	unsigned char index[TB_INDEX_SIZE];
+	char inbuf[1 << 16];
+
+	if (xz) {
+		memset(&mt, 0, sizeof mt);
+		mt.threads = xz_threads != 0 ? xz_threads : lzma_cputhreads();
+		if (mt.threads == 0)
+			mt.threads = 1;
+
+		mt.memlimit_threading = xz_memlimit != 0 ? xz_memlimit : lzma_physmem() / 4;
+		mt.memlimit_stop = UINT64_MAX;
+		error = lzma_stream_decoder_mt(&strm, &mt);
+	}
+
+	/* liblzma may have been built without support for threads */
+	if (error == LZMA_OPTIONS_ERROR || error == LZMA_PROG_ERROR)
+		error = lzma_auto_decoder(&strm, UINT64_MAX, 0);
 
-	error = lzma_auto_decoder(&strm, UINT64_MAX, 0);
 	switch (error) {
 	case LZMA_OK:
 		break;
@@ -163,35 +683,67 @@ read_xz_tablebase(FILE *f, struct tablebase *tb)
 		abort();
 	}
 
+	/* the header, the data, and the index are decompressed in turn */
 	strm.next_out = (uint8_t *)tb->positions;
-	strm.avail_out = sizeof tb->positions;
+	strm.avail_out = TB_HEADER_SIZE;
 	strm.avail_in = 0;
 
 	do {
-		if (strm.avail_in > 0)
-			memmove(inbuf, inbuf + (sizeof inbuf - strm.avail_in), strm.avail_in);
-
-		count = fread(inbuf + strm.avail_in, 1, sizeof inbuf - strm.avail_in, f);
-		if (count == 0 && (feof(f) || ferror(f))) {
-			lzma_end(&strm);
-			return (1);
+		if (strm.avail_in == 0 && action == LZMA_RUN) {
+			count = fread(inbuf, 1, sizeof inbuf, f);
+			if (ferror(f)) {
+				lzma_end(&strm);
+				return (1);
+			}
+
+			/* let the decoder finish what it has buffered */
+			if (count == 0)
+				action = LZMA_FINISH;
+
+			strm.next_in = (uint8_t *)inbuf;
+			strm.avail_in = count;
 		}
 
-		strm.next_in = (uint8_t *)inbuf;
-		strm.avail_in += count;
-		error = lzma_code(&strm, LZMA_RUN);
+		error = lzma_code(&strm, action);
+		if (part == 1)
+			atomic_store(&tb_progress, strm.next_out - (uint8_t *)tb->positions);
+
+		if (error != LZMA_OK || strm.avail_out > 0 || part == 2)
+			continue;
+
+		switch (part++) {
+		case 0:
+			if (check_tbheader((unsigned char *)tb->positions) != 0) {
+				lzma_end(&strm);
+				return (1);
+			}
+
+			strm.next_out = (uint8_t *)tb->positions;
+			strm.avail_out = TB_DATA_SIZE;
+			break;
+
+		case 1:
+			strm.next_out = index;
+			strm.avail_out = sizeof index;
+			break;
+		}
 	} while (error == LZMA_OK);
 
 	lzma_end(&strm);
 
 	switch (error) {
 	case LZMA_STREAM_END:
-		return (strm.avail_out != 0);
+		if (part != 2 || strm.avail_out != 0
+		    || check_tbindex(index, crc, ref) != 0 || verify_sections(tb, crc, ref) != 0) {
+			errno = EINVAL;
+			return (1);
+		}
+
+		return (0);
 
 	case LZMA_FORMAT_ERROR:
 		return (2);
 
-	case LZMA_BUF_ERROR:
 	case LZMA_PROG_ERROR:
 	case LZMA_OPTIONS_ERROR:
 	case LZMA_OK:
@@ -199,6 +751,7 @@ read_xz_tablebase(FILE *f, struct tablebase *tb)
 		abort();
 
 	default:
+		errno = error == LZMA_MEM_ERROR ? ENOMEM : EINVAL;
 		return (1);
 	}
 }
@@ -0,0 +1,572 @@
+/*-
+ * Copyright (c) 2026 Robert Clausecker. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <lzma.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dobutsutable.h"
+
+/*
+ * An xz file consists of blocks that are compressed independently.
+ * The index at the end of the file records where each block is and
+ * which part of the uncompressed data it holds.  When the table base
+ * is written in many small blocks (see gentb -b), individual blocks can
+ * be decompressed when they are first probed instead of decompressing
+ * the whole table on startup.  A struct tbcache keeps the most recently
+ * used decompressed blocks in a fixed number of slots, evicting the
+ * least recently used block when a new block is needed.
+ *
+ * For each block, start is the offset of its first byte in the
+ * decompressed file, size the number of bytes it holds, offset the
+ * location of the block in the file, total_size its compressed size
+ * including the header and unpadded_size the same without padding,
+ * and slot the slot holding the block or NULL if the block is not
+ * cached.
+ */
+struct tbcache_block {
+	uint64_t start, offset, total_size, unpadded_size;
+	size_t size;
+	struct tbcache_slot *slot;
+};
+
+/*
+ * A slot holds the decompressed data of block.  Slots form a doubly
+ * linked list in the order of their last use, lru.next being the most
+ * recently used one.
+ */
+struct tbcache_slot {
+	struct tbcache_slot *prev, *next;
+	struct tbcache_block *block;
+	unsigned char *data;
+};
+
+/*
+ * The cache of a table base.  fd is a file descriptor for the
+ * compressed file, check the kind of check the blocks are protected
+ * with and inbuf a buffer large enough to hold any compressed block.
+ * lock protects everything as lookups may happen from multiple
+ * threads.
+ */
+struct tbcache {
+	pthread_mutex_t lock;
+	int fd;
+	lzma_check check;
+	struct tbcache_block *blocks;
+	size_t nblocks;
+	struct tbcache_slot *slots, lru;
+	unsigned char *inbuf;
+};
+
+static size_t	 tbcache_budget = 0;
+
+static int	 read_index(struct tbcache *, size_t);
+static int	 check_container(struct tbcache *, uint64_t *, unsigned *);
+static int	 read_live(struct tablebase *, const uint64_t *, const unsigned *);
+static int	 cached_read(struct tbcache *, size_t, unsigned char *, size_t);
+static struct tbcache_block *use_block(struct tbcache *, size_t);
+static struct tbcache_block *find_block(struct tbcache *, size_t);
+static int	 load_block(struct tbcache *, struct tbcache_block *, struct tbcache_slot *);
+
+/*
+ * Set the amount of memory read_tablebase() may use for caching
+ * decompressed blocks of xz compressed table bases to budget bytes.
+ * If budget is 0 (the default), compressed table bases are decompressed
+ * in full while loading.
+ */
+extern void
+set_tablebase_cache(size_t budget)
+{
+
+	tbcache_budget = budget;
+}
+
+/*
+ * Open the xz compressed table base in f for lazy decompression
+ * through a cache of decompressed blocks as configured with
+ * set_tablebase_cache().  Only the live bitmap is decompressed right
+ * away as every lookup needs it.  f can be closed afterwards.  Return
+ * the table base on success or NULL on failure with errno set.  If no
+ * cache budget is configured, the file has only a few blocks or the
+ * blocks are larger than the budget, errno is set to EOPNOTSUPP and
+ * the table base should be decompressed in full instead.
+ */
+extern struct tablebase *
+open_cached_tablebase(FILE *f)
+{
+	struct tablebase *tb;
+	struct tbcache *cache;
+	size_t i, nslots = 0, maxsize = 0;
+	uint64_t maxtotal = 0, crc[OWNERSHIP_COUNT + 1];
+	unsigned ref[OWNERSHIP_COUNT];
+	int error;
+
+	if (tbcache_budget == 0) {
+		errno = EOPNOTSUPP;
+		return (NULL);
+	}
+
+	tb = malloc(sizeof *tb);
+	cache = malloc(sizeof *cache);
+	if (tb == NULL || cache == NULL) {
+		free(tb);
+		free(cache);
+		return (NULL);
+	}
+
+	cache->blocks = NULL;
+	cache->slots = NULL;
+	cache->inbuf = NULL;
+	cache->lru.prev = cache->lru.next = &cache->lru;
+	cache->fd = dup(fileno(f));
+	if (cache->fd == -1) {
+		error = errno;
+		goto fail;
+	}
+
+	if (read_index(cache, TB_FILE_SIZE) != 0) {
+		error = errno;
+		goto fail;
+	}
+
+	for (i = 0; i < cache->nblocks; i++) {
+		if (cache->blocks[i].size > maxsize)
+			maxsize = cache->blocks[i].size;
+
+		if (cache->blocks[i].total_size > maxtotal)
+			maxtotal = cache->blocks[i].total_size;
+	}
+
+	/* caching only makes sense with a reasonable number of blocks */
+	nslots = tbcache_budget / maxsize;
+	if (nslots == 0 || cache->nblocks < 4) {
+		error = EOPNOTSUPP;
+		goto fail;
+	}
+
+	if (nslots > cache->nblocks)
+		nslots = cache->nblocks;
+
+	cache->inbuf = malloc(maxtotal);
+	cache->slots = calloc(nslots, sizeof *cache->slots);
+	if (cache->inbuf == NULL || cache->slots == NULL) {
+		error = errno;
+		goto fail;
+	}
+
+	/* slots without a block are least recently used */
+	for (i = 0; i < nslots; i++) {
+		cache->slots[i].data = malloc(maxsize);
+		if (cache->slots[i].data == NULL) {
+			error = errno;
+			goto fail;
+		}
+
+		cache->slots[i].block = NULL;
+		cache->slots[i].prev = cache->lru.prev;
+		cache->slots[i].next = &cache->lru;
+		cache->lru.prev->next = cache->slots + i;
+		cache->lru.prev = cache->slots + i;
+	}
+
+	error = pthread_mutex_init(&cache->lock, NULL);
+	if (error != 0)
+		goto fail;
+
+	tb->positions = NULL;
+	tb->size = TB_DATA_SIZE;
+	tb->mapping = 0;
+	tb->cache = cache;
+	tb->pack = NULL;
+	tb->live.bits = NULL;
+	tb->live.ranks = NULL;
+	tb->live.copy = NULL;
+	tb->wdl = 0;
+
+	if (check_container(cache, crc, ref) != 0 || read_live(tb, crc, ref) != 0) {
+		error = errno;
+		free_tablebase(tb);
+		errno = error;
+		return (NULL);
+	}
+
+	return (tb);
+
+fail:
+	if (cache->slots != NULL)
+		for (i = 0; i < nslots; i++)
+			free(cache->slots[i].data);
+
+	free(cache->slots);
+	free(cache->inbuf);
+	free(cache->blocks);
+	if (cache->fd != -1)
+		close(cache->fd);
+
+	free(cache);
+	free(tb);
+	errno = error;
+
+	return (NULL);
+}
+
+/*
+ * Look up the n entries at offsets in the cached table base cache and
+ * store them in out, decompressing the blocks they are in as needed.
+ * The lock is taken once for all of them.  Return 0 on success or -1
+ * with errno set if a block cannot be read or is damaged.
+ */
+extern int
+cached_entries(struct tbcache *cache, const size_t *offsets, size_t n, tb_entry *out)
+{
+	struct tbcache_block *block;
+	size_t i, offset;
+
+	pthread_mutex_lock(&cache->lock);
+	for (i = 0; i < n; i++) {
+		offset = TB_HEADER_SIZE + offsets[i];
+		block = use_block(cache, offset);
+		if (block == NULL) {
+			pthread_mutex_unlock(&cache->lock);
+			return (-1);
+		}
+
+		out[i] = (signed char)block->slot->data[offset - block->start];
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return (0);
+}
+
+/*
+ * Copy the len bytes at offset in the decompressed file of cache to
+ * buf, decompressing the blocks they are in as needed.  Return 0 on
+ * success or -1 with errno set if a block cannot be read or is
+ * damaged.
+ */
+static int
+cached_read(struct tbcache *cache, size_t offset, unsigned char *buf, size_t len)
+{
+	struct tbcache_block *block;
+	size_t n;
+
+	pthread_mutex_lock(&cache->lock);
+	while (len > 0) {
+		block = use_block(cache, offset);
+		if (block == NULL) {
+			pthread_mutex_unlock(&cache->lock);
+			return (-1);
+		}
+
+		n = block->start + block->size - offset;
+		if (n > len)
+			n = len;
+
+		memcpy(buf, block->slot->data + (offset - block->start), n);
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return (0);
+}
+
+/*
+ * Return the block holding the byte at offset in the decompressed file
+ * of cache, decompressing it into a slot if needed, and mark the slot
+ * as most recently used.  cache->lock must be held.  If the block
+ * cannot be decompressed, return NULL with errno set.
+ */
+static struct tbcache_block *
+use_block(struct tbcache *cache, size_t offset)
+{
+	struct tbcache_block *block;
+	struct tbcache_slot *slot;
+
+	block = find_block(cache, offset);
+	slot = block->slot;
+	if (slot == NULL) {
+		/* evict the least recently used block */
+		slot = cache->lru.prev;
+		if (slot->block != NULL) {
+			slot->block->slot = NULL;
+			slot->block = NULL;
+		}
+
+		if (load_block(cache, block, slot) != 0)
+			return (NULL);
+	}
+
+	/* move slot to the front of the LRU list */
+	slot->prev->next = slot->next;
+	slot->next->prev = slot->prev;
+	slot->prev = &cache->lru;
+	slot->next = cache->lru.next;
+	cache->lru.next->prev = slot;
+	cache->lru.next = slot;
+
+	return (block);
+}
+
+/*
+ * Check the header and the index of the table base in cache and store
+ * the checksums and the reference sections from the index in crc and
+ * ref.  The checksums of the sections
+ * are not verified as that would require decompressing the whole file,
+ * but each block is protected by its own check.  Return 0 if they are
+ * valid, -1 with errno set to EINVAL otherwise or to why they could
+ * not be read.
+ */
+static int
+check_container(struct tbcache *cache, uint64_t *crc, unsigned *ref)
+{
+	unsigned char header[TB_HEADER_LEN], index[TB_INDEX_SIZE];
+
+	if (cached_read(cache, 0, header, sizeof header) != 0
+	    || check_tbheader(header) != 0)
+		return (-1);
+
+	if (cached_read(cache, TB_HEADER_SIZE + TB_DATA_SIZE, index, sizeof index) != 0)
+		return (-1);
+
+	return (check_tbindex(index, crc, ref));
+}
+
+/*
+ * Decompress the live bitmap of tb, a table base decompressed lazily,
+ * check it against its checksum in crc, restore it from the reference
+ * sections ref, and index it.  Return 0 on success, -1 on error with
+ * errno set.
+ */
+static int
+read_live(struct tablebase *tb, const uint64_t *crc, const unsigned *ref)
+{
+
+	tb->live.copy = malloc(LIVE_SIZE);
+	if (tb->live.copy == NULL)
+		return (-1);
+
+	if (cached_read(tb->cache, TB_HEADER_SIZE + TB_LIVE_OFFSET, tb->live.copy, LIVE_SIZE) != 0)
+		return (-1);
+
+	if (lzma_crc64(tb->live.copy, LIVE_SIZE, 0) != crc[OWNERSHIP_COUNT]) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	restore_live(tb->live.copy, ref);
+
+	return (index_live(&tb->live, tb->live.copy));
+}
+
+/*
+ * Release all storage associated with cache.
+ */
+extern void
+free_tablebase_cache(struct tbcache *cache)
+{
+
+	struct tbcache_slot *slot, *next;
+
+	if (cache == NULL)
+		return;
+
+	pthread_mutex_destroy(&cache->lock);
+	for (slot = cache->lru.next; slot != &cache->lru; slot = next) {
+		next = slot->next;
+		free(slot->data);
+	}
+
+	free(cache->slots);
+	free(cache->inbuf);
+	free(cache->blocks);
+	close(cache->fd);
+	free(cache);
+}
+
+/*
+ * Read the index of the xz file cache->fd and fill in the block
+ * table of cache.  The file must hold a single stream containing
+ * size bytes.  Return 0 on success, -1 on error with errno set.
+ */
+static int
+read_index(struct tbcache *cache, size_t size)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_index *index = NULL;
+	lzma_index_iter iter;
+	lzma_ret ret;
+	struct stat st;
+	struct tbcache_block *block;
+	ssize_t count;
+	off_t pos = 0;
+	uint8_t buf[BUFSIZ];
+
+	if (fstat(cache->fd, &st) != 0)
+		return (-1);
+
+	/* the index is at the end, lzma tells us where to look */
+	if (lzma_file_info_decoder(&strm, &index, UINT64_MAX, st.st_size) != LZMA_OK) {
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	do {
+		if (strm.avail_in == 0) {
+			count = pread(cache->fd, buf, sizeof buf, pos);
+			if (count <= 0) {
+				lzma_end(&strm);
+				errno = count == 0 ? EINVAL : errno;
+				return (-1);
+			}
+
+			pos += count;
+			strm.next_in = buf;
+			strm.avail_in = count;
+		}
+
+		ret = lzma_code(&strm, LZMA_RUN);
+		if (ret == LZMA_SEEK_NEEDED) {
+			pos = strm.seek_pos;
+			strm.avail_in = 0;
+			ret = LZMA_OK;
+		}
+	} while (ret == LZMA_OK);
+
+	lzma_end(&strm);
+	if (ret != LZMA_STREAM_END) {
+		errno = ret == LZMA_MEM_ERROR ? ENOMEM : EINVAL;
+		return (-1);
+	}
+
+	if (lzma_index_stream_count(index) != 1
+	    || lzma_index_uncompressed_size(index) != size) {
+		lzma_index_end(index, NULL);
+		errno = EINVAL;
+		return (-1);
+	}
+
+	cache->nblocks = lzma_index_block_count(index);
+	cache->blocks = malloc(cache->nblocks * sizeof *cache->blocks);
+	if (cache->blocks == NULL) {
+		lzma_index_end(index, NULL);
+		return (-1);
+	}
+
+	lzma_index_iter_init(&iter, index);
+	for (block = cache->blocks; !lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK); block++) {
+		block->start = iter.block.uncompressed_file_offset;
+		block->size = iter.block.uncompressed_size;
+		block->offset = iter.block.compressed_file_offset;
+		block->total_size = iter.block.total_size;
+		block->unpadded_size = iter.block.unpadded_size;
+		block->slot = NULL;
+		cache->check = iter.stream.flags->check;
+	}
+
+	lzma_index_end(index, NULL);
+
+	return (0);
+}
+
+/*
+ * Find the block holding offset by binary search.
+ */
+static struct tbcache_block *
+find_block(struct tbcache *cache, size_t offset)
+{
+	size_t lo = 0, hi = cache->nblocks, mid;
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (cache->blocks[mid].start <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return (cache->blocks + lo);
+}
+
+/*
+ * Decompress block into slot.  Return 0 on success or -1 with errno
+ * set if the block cannot be read.  A truncated or damaged block sets
+ * errno to EINVAL.
+ */
+static int
+load_block(struct tbcache *cache, struct tbcache_block *block, struct tbcache_slot *slot)
+{
+	lzma_block lb;
+	lzma_filter filters[LZMA_FILTERS_MAX + 1];
+	lzma_ret ret;
+	size_t in_pos, out_pos = 0;
+	ssize_t count;
+
+	count = pread(cache->fd, cache->inbuf, block->total_size, block->offset);
+	if (count < 0)
+		return (-1);
+
+	if ((uint64_t)count != block->total_size) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	memset(&lb, 0, sizeof lb);
+	lb.version = 0;
+	lb.check = cache->check;
+	lb.filters = filters;
+	lb.header_size = lzma_block_header_size_decode(cache->inbuf[0]);
+
+	ret = lzma_block_header_decode(&lb, NULL, cache->inbuf);
+	if (ret == LZMA_OK) {
+		ret = lzma_block_compressed_size(&lb, block->unpadded_size);
+		if (ret == LZMA_OK) {
+			in_pos = lb.header_size;
+			ret = lzma_block_buffer_decode(&lb, NULL, cache->inbuf, &in_pos,
+			    block->total_size, slot->data, &out_pos, block->size);
+		}
+
+		lzma_filters_free(filters, NULL);
+	}
+
+	if (ret != LZMA_OK || out_pos != block->size) {
+		errno = ret == LZMA_MEM_ERROR ? ENOMEM : EINVAL;
+		return (-1);
+	}
+
+	slot->block = block;
+	block->slot = slot;
+
+	return (0);
+}
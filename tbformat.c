@@ -0,0 +1,381 @@
+/*-
+ * Copyright (c) 2026 Robert Clausecker. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <lzma.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dobutsutable.h"
+
+/*
+ * A tablebase file begins with a header of TB_HEADER_SIZE bytes of
+ * which the first TB_HEADER_LEN bytes are used.  All numbers are
+ * stored in little endian byte order.  The header holds:
+ *
+ *   0  magic number (8 bytes)
+ *   8  format version TB_VERSION (4 bytes)
+ *  12  flags, currently 0 (4 bytes)
+ *  16  offset of the positions, TB_HEADER_SIZE (8 bytes)
+ *  24  number of slots, POSITION_COUNT (8 bytes)
+ *  32  fingerprint of the table layout (8 bytes)
+ *  40  number of sections, OWNERSHIP_COUNT (4 bytes)
+ *  44  number of slots in a section, TB_SECTION_SIZE (4 bytes)
+ *  48  offset of the index (8 bytes)
+ *  56  size of the index, TB_INDEX_SIZE (8 bytes)
+ *  64  number of live positions, LIVE_COUNT (8 bytes)
+ *  72  offset of the live bitmap (8 bytes)
+ *  80  CRC64 of the preceding 80 bytes (8 bytes)
+ *
+ * The fingerprint is a CRC64 over the tables that determine where each
+ * position is stored, so a file generated with a different encoding is
+ * rejected before its positions are looked at.  The entries of the live
+ * positions follow the header, padded to the next multiple of
+ * LIVE_BLOCK / 8 bytes, then come the live bitmap and the index.  For
+ * each section in the order of the table, the index holds a 32 byte
+ * entry:
+ *
+ *   0  the ownership class stored in the section (4 bytes)
+ *   4  reference section for the live bitmap plus one, or 0 (4 bytes)
+ *   8  offset of the section in the file (8 bytes)
+ *  16  size of the section (8 bytes)
+ *  24  CRC64 of the section (8 bytes)
+ *
+ * The sections are stored back to back.  An entry of the same form for
+ * the live bitmap follows, with OWNERSHIP_TOTAL_COUNT in place of the
+ * ownership class and 0 in place of the reference section.  A CRC64 of
+ * all entries ends the index.
+ *
+ * Sections with similar ownership classes tend to have similar live
+ * positions.  If a section has a reference section, which must come
+ * before it, its part of the live bitmap is stored exclusive-or'ed
+ * with that of the reference section, which compresses much better.
+ * The checksum of the live bitmap is taken over the bitmap as stored.
+ *
+ * Win/draw/loss bitbases have a header of the same size with a
+ * different magic number, of which the first WDL_HEADER_LEN bytes are
+ * used.  The entries follow the header, there is no index:
+ *
+ *   0  magic number (8 bytes)
+ *   8  format version TB_VERSION (4 bytes)
+ *  12  flags, currently 0 (4 bytes)
+ *  16  offset of the entries, TB_HEADER_SIZE (8 bytes)
+ *  24  number of positions, POSITION_COUNT (8 bytes)
+ *  32  fingerprint of the table layout (8 bytes)
+ *  40  size of the entries, WDL_SIZE (8 bytes)
+ *  48  CRC64 of the entries (8 bytes)
+ *  56  CRC64 of the preceding 56 bytes (8 bytes)
+ */
+static const unsigned char tb_magic[8] = { 'D', 'B', 'T', 'B', '\r', '\n', 0x1a, '\n' };
+static const unsigned char wdl_magic[8] = { 'D', 'B', 'W', 'L', '\r', '\n', 0x1a, '\n' };
+
+static void	put_le(unsigned char *, uint64_t, size_t);
+static uint64_t	get_le(const unsigned char *, size_t);
+
+/*
+ * Fill buf, a buffer of TB_HEADER_SIZE bytes, with the header for a
+ * tablebase of the current layout.
+ */
+extern void
+make_tbheader(unsigned char *buf)
+{
+
+	memset(buf, 0, TB_HEADER_SIZE);
+	memcpy(buf, tb_magic, sizeof tb_magic);
+	put_le(buf + 8, TB_VERSION, 4);
+	put_le(buf + 12, 0, 4);
+	put_le(buf + 16, TB_HEADER_SIZE, 8);
+	put_le(buf + 24, POSITION_COUNT, 8);
+	put_le(buf + 32, layout_fingerprint(), 8);
+	put_le(buf + 40, OWNERSHIP_COUNT, 4);
+	put_le(buf + 44, TB_SECTION_SIZE, 4);
+	put_le(buf + 48, TB_HEADER_SIZE + TB_DATA_SIZE, 8);
+	put_le(buf + 56, TB_INDEX_SIZE, 8);
+	put_le(buf + 64, LIVE_COUNT, 8);
+	put_le(buf + 72, TB_HEADER_SIZE + TB_LIVE_OFFSET, 8);
+	put_le(buf + 80, lzma_crc64(buf, 80, 0), 8);
+}
+
+/*
+ * Check if buf, the first TB_HEADER_LEN bytes of a tablebase file,
+ * holds a header we understand describing a tablebase of the current
+ * layout.  Return 0 if it does, -1 with errno set to EINVAL otherwise.
+ */
+extern int
+check_tbheader(const unsigned char *buf)
+{
+
+	if (memcmp(buf, tb_magic, sizeof tb_magic) != 0
+	    || get_le(buf + 80, 8) != lzma_crc64(buf, 80, 0)
+	    || get_le(buf + 8, 4) != TB_VERSION
+	    || get_le(buf + 12, 4) != 0
+	    || get_le(buf + 16, 8) != TB_HEADER_SIZE
+	    || get_le(buf + 24, 8) != POSITION_COUNT
+	    || get_le(buf + 32, 8) != layout_fingerprint()
+	    || get_le(buf + 40, 4) != OWNERSHIP_COUNT
+	    || get_le(buf + 44, 4) != TB_SECTION_SIZE
+	    || get_le(buf + 48, 8) != TB_HEADER_SIZE + TB_DATA_SIZE
+	    || get_le(buf + 56, 8) != TB_INDEX_SIZE
+	    || get_le(buf + 64, 8) != LIVE_COUNT
+	    || get_le(buf + 72, 8) != TB_HEADER_SIZE + TB_LIVE_OFFSET) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Fill buf, a buffer of TB_INDEX_SIZE bytes, with the index for a
+ * tablebase whose sections hold the number of entries in size, have
+ * the checksums in crc, and the reference sections in ref (see
+ * predict_live()).  The checksum of the live bitmap is
+ * crc[OWNERSHIP_COUNT].
+ */
+extern void
+make_tbindex(unsigned char *buf, const uint64_t *crc, const size_t *size,
+    const unsigned *ref)
+{
+	size_t i, o, offset = TB_HEADER_SIZE;
+	unsigned char *entry;
+
+	memset(buf, 0, TB_INDEX_SIZE);
+	for (i = 0; i < OWNERSHIP_COUNT; i++) {
+		for (o = 0; ownership_map[o] != i; o++)
+			;
+
+		entry = buf + 32 * i;
+		put_le(entry, o, 4);
+		put_le(entry + 4, ref[i] == i ? 0 : ref[i] + 1, 4);
+		put_le(entry + 8, offset, 8);
+		put_le(entry + 16, size[i], 8);
+		put_le(entry + 24, crc[i], 8);
+		offset += size[i];
+	}
+
+	entry = buf + 32 * OWNERSHIP_COUNT;
+	put_le(entry, OWNERSHIP_TOTAL_COUNT, 4);
+	put_le(entry + 8, TB_HEADER_SIZE + TB_LIVE_OFFSET, 8);
+	put_le(entry + 16, LIVE_SIZE, 8);
+	put_le(entry + 24, crc[OWNERSHIP_COUNT], 8);
+
+	put_le(buf + 32 * (OWNERSHIP_COUNT + 1), lzma_crc64(buf, 32 * (OWNERSHIP_COUNT + 1), 0), 8);
+}
+
+/*
+ * Check if buf holds a valid index for a tablebase of the current
+ * layout and store the checksums of the sections and of the live
+ * bitmap in crc, an array of OWNERSHIP_COUNT + 1 elements, and the
+ * reference sections in ref, an array of OWNERSHIP_COUNT elements.
+ * The sizes of the sections cannot be checked without the live
+ * bitmap, but they must add up to LIVE_COUNT.  Return 0 on success,
+ * -1 with errno set to EINVAL if the index is invalid.
+ */
+extern int
+check_tbindex(const unsigned char *buf, uint64_t *crc, unsigned *ref)
+{
+	size_t i;
+	uint64_t o, r, offset = TB_HEADER_SIZE;
+	const unsigned char *entry;
+
+	if (get_le(buf + 32 * (OWNERSHIP_COUNT + 1), 8) != lzma_crc64(buf, 32 * (OWNERSHIP_COUNT + 1), 0))
+		goto invalid;
+
+	for (i = 0; i < OWNERSHIP_COUNT; i++) {
+		entry = buf + 32 * i;
+		o = get_le(entry, 4);
+		r = get_le(entry + 4, 4);
+		if (o >= OWNERSHIP_TOTAL_COUNT || ownership_map[o] != i || r > i
+		    || get_le(entry + 8, 8) != offset
+		    || get_le(entry + 16, 8) > TB_HEADER_SIZE + LIVE_COUNT - offset)
+			goto invalid;
+
+		offset += get_le(entry + 16, 8);
+		crc[i] = get_le(entry + 24, 8);
+		ref[i] = r == 0 ? i : r - 1;
+	}
+
+	entry = buf + 32 * OWNERSHIP_COUNT;
+	if (offset != TB_HEADER_SIZE + LIVE_COUNT
+	    || get_le(entry, 4) != OWNERSHIP_TOTAL_COUNT
+	    || get_le(entry + 4, 4) != 0
+	    || get_le(entry + 8, 8) != TB_HEADER_SIZE + TB_LIVE_OFFSET
+	    || get_le(entry + 16, 8) != LIVE_SIZE)
+		goto invalid;
+
+	crc[OWNERSHIP_COUNT] = get_le(entry + 24, 8);
+
+	return (0);
+
+invalid:
+	errno = EINVAL;
+	return (-1);
+}
+
+/*
+ * Check the sections and the live bitmap of tb, which must not be
+ * decompressed lazily, against the checksums in crc.  The bitmap is
+ * checked first as it tells where the sections end.  Then it is
+ * restored in place from the reference sections ref.  Return 0 if all
+ * match, -1 with errno set to EINVAL otherwise.
+ */
+extern int
+verify_sections(struct tablebase *tb, const uint64_t *crc, const unsigned *ref)
+{
+	struct tblive live = { NULL, NULL, NULL };
+	uint8_t *data = (uint8_t *)tb->positions;
+	size_t i, begin, end = 0;
+
+	if (lzma_crc64(data + TB_LIVE_OFFSET, LIVE_SIZE, 0) != crc[OWNERSHIP_COUNT])
+		goto invalid;
+
+	restore_live(data + TB_LIVE_OFFSET, ref);
+
+	if (index_live(&live, data + TB_LIVE_OFFSET) != 0)
+		return (-1);
+
+	for (i = 0; i < OWNERSHIP_COUNT; i++) {
+		begin = end;
+		end = i + 1 < OWNERSHIP_COUNT ? live_rank(&live, (i + 1) * TB_SECTION_SIZE) : LIVE_COUNT;
+		if (lzma_crc64(data + begin, end - begin, 0) != crc[i]) {
+			free_live(&live);
+			goto invalid;
+		}
+	}
+
+	free_live(&live);
+
+	return (0);
+
+invalid:
+	errno = EINVAL;
+	return (-1);
+}
+
+/*
+ * Fill buf, a buffer of TB_HEADER_SIZE bytes, with the header for a
+ * bitbase of the current layout whose entries have the checksum crc.
+ */
+extern void
+make_wdlheader(unsigned char *buf, uint64_t crc)
+{
+
+	memset(buf, 0, TB_HEADER_SIZE);
+	memcpy(buf, wdl_magic, sizeof wdl_magic);
+	put_le(buf + 8, TB_VERSION, 4);
+	put_le(buf + 12, 0, 4);
+	put_le(buf + 16, TB_HEADER_SIZE, 8);
+	put_le(buf + 24, POSITION_COUNT, 8);
+	put_le(buf + 32, layout_fingerprint(), 8);
+	put_le(buf + 40, WDL_SIZE, 8);
+	put_le(buf + 48, crc, 8);
+	put_le(buf + 56, lzma_crc64(buf, 56, 0), 8);
+}
+
+/*
+ * Check if buf, the first WDL_HEADER_LEN bytes of a file, holds the
+ * header of a bitbase of the current layout and store the checksum of
+ * its entries in crc.  Return 0 if it does, -1 with errno set to
+ * EINVAL otherwise.
+ */
+extern int
+check_wdlheader(const unsigned char *buf, uint64_t *crc)
+{
+
+	if (memcmp(buf, wdl_magic, sizeof wdl_magic) != 0
+	    || get_le(buf + 56, 8) != lzma_crc64(buf, 56, 0)
+	    || get_le(buf + 8, 4) != TB_VERSION
+	    || get_le(buf + 12, 4) != 0
+	    || get_le(buf + 16, 8) != TB_HEADER_SIZE
+	    || get_le(buf + 24, 8) != POSITION_COUNT
+	    || get_le(buf + 32, 8) != layout_fingerprint()
+	    || get_le(buf + 40, 8) != WDL_SIZE) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	*crc = get_le(buf + 48, 8);
+
+	return (0);
+}
+
+/*
+ * Compute a fingerprint of the tables describing the layout of the
+ * tablebase.  The tables are serialised in little endian byte order
+ * first, so the fingerprint does not depend on the machine.
+ */
+extern uint64_t
+layout_fingerprint(void)
+{
+	size_t i;
+	uint64_t crc = 0;
+	unsigned char buf[8];
+
+	put_le(buf, POSITION_TOTAL_COUNT, 8);
+	crc = lzma_crc64(buf, 8, crc);
+	put_le(buf, POSITION_COUNT, 8);
+	crc = lzma_crc64(buf, 8, crc);
+
+	for (i = 0; i < COHORT_COUNT; i++) {
+		crc = lzma_crc64(cohort_info[i].pieces, 3, crc);
+		crc = lzma_crc64(&cohort_info[i].status, 1, crc);
+		crc = lzma_crc64(cohort_info[i].sizes, 3, crc);
+		put_le(buf, cohort_size[i].offset, 4);
+		put_le(buf + 4, cohort_size[i].size, 4);
+		crc = lzma_crc64(buf, 8, crc);
+		put_le(buf, valid_ownership_map[i], 8);
+		crc = lzma_crc64(buf, 8, crc);
+	}
+
+	return (lzma_crc64(ownership_map, OWNERSHIP_TOTAL_COUNT, crc));
+}
+
+/*
+ * Store the len least significant bytes of x in buf in little endian
+ * byte order.
+ */
+static void
+put_le(unsigned char *buf, uint64_t x, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = x >> 8 * i & 0xff;
+}
+
+/*
+ * Load a little endian number of len bytes from buf.
+ */
+static uint64_t
+get_le(const unsigned char *buf, size_t len)
+{
+	uint64_t x = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		x |= (uint64_t)buf[i] << 8 * i;
+
+	return (x);
+}
@@ -23,76 +23,270 @@
  * SUCH DAMAGE.
  */
 #define _POSIX_C_SOURCE 200809L
+#ifdef __linux__
+# define _GNU_SOURCE /* for CPU_SET() and pthread_setaffinity_np() */
+#endif
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <lzma.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#ifdef __linux__
+# include <sched.h>
+#endif
 
 #include "dobutsutable.h"
 
-static void	*gentb_worker(void *);
-static void	 initial_round_chunk(struct tablebase *, poscode, unsigned *, unsigned *);
-static void	 initial_round_pos(struct tablebase *, poscode, unsigned *, unsigned *);
-static void	 normal_round_chunk(struct tablebase *, poscode, unsigned *, unsigned *, unsigned);
-static void	 normal_round_pos(struct tablebase *, poscode, int, unsigned *, unsigned *);
-static void	 mark_position(struct tablebase *, const struct position *, tb_entry);
-static void	 count_wdl(struct tablebase *);
-
-/*
- * This structure is used to coordinate work between the threads.  The
- * members win, loss, round, and pc may only be modified while lock is
- * held.  round_barrier is used to synchronize the threads after one
- * round has finished.  win and loss contain the number of winning and
- * losing positions in the current round, round the current round and
- * pc the last chunk of the encoding space fetched for work.  The member
- * tb contains a pointer to the tablebase we currently work on.  It must
- * not be written asynchronously, lock doesn't need to be held to access
- * it.
+/*
+ * Every round after the first only needs to look at the positions that
+ * were marked as won in the previous round, the frontier.  The frontier
+ * is recorded in one of two representations: a bitmap with one bit for
+ * each position in the table or a list of position offsets.  The
+ * bitmap is used while the frontier is large, the list once the number
+ * of wins per round drops below FRONTIER_LIST_LIMIT.  A list entry
+ * takes 32 bits, so at that size the lists take about half as much
+ * space as the bitmap.  In rounds using lists, work is handed out in
+ * slices of FRONTIER_CHUNK list entries.
  *
- * The workflow is as follows: Every thread has an internal round
- * counter.  When looking for work, the thread first locks lock and then
- * compares its own round counter to round.  If the values differ that
- * means that this thread is the first to do work on the new round and
- * initializes win, loss, and pc.  Then the thread takes one chunk of
- * work, increments pc appropriately and releases lock.  If the thread
- * was the first to do work in this round, it prints status information
- * from the previous round.  If no work is left to do, the thread
- * instead waits on round_barrier.  As a special case, if the thread
- * notices that it's the first to do work in the current round and the
- * loss counter stands at zero (meaning, no losses were found in the
- * previous round) then it leaves the state unchanged and terminates.
+ * In the first round and in rounds using the bitmap, work is handed out
+ * in chunks of about CHUNK_TARGET positions.  Cohorts larger than that
+ * are split by lion position, smaller cohorts are batched together.
  */
-struct gentb_state {
-	pthread_mutex_t lock;
+enum {
+	FRONTIER_BITMAP,
+	FRONTIER_LIST,
 
-	/* members for which lock must be held */
-	unsigned win, loss;
-	unsigned round;
-	poscode pc;
+	FRONTIER_LIST_LIMIT = POSITION_TOTAL_COUNT / 64,
+	FRONTIER_CHUNK = 4096,
+	FRONTIER_BITMAP_SIZE = (POSITION_TOTAL_COUNT + CHAR_BIT - 1) / CHAR_BIT,
+
+	CHUNK_TARGET = 32768,
+	MAX_DENSE_CHUNKS = OWNERSHIP_TOTAL_COUNT * COHORT_COUNT * LIONPOS_COUNT,
+
+	CHECKPOINT_VERSION = 1,
+
+	MAX_CPUS = 1024,
+	MAX_NODES = 64,
+
+	/* choose_refs() compares the entries of every REF_STRIDE th slot */
+	REF_STRIDE = 7,
+};
+
+/*
+ * A list of position offsets making up (a part of) the frontier.
+ */
+struct frontier_list {
+	unsigned *offsets;
+	size_t len, cap;
+};
+
+/*
+ * A chunk of work.  In the first round and in rounds using the frontier
+ * bitmap, a chunk covers the cohorts cohort to cohort_end - 1 of
+ * ownership class ownership, restricted to lion positions lionpos to
+ * lionpos_end - 1.  Only chunks covering a single cohort cover less
+ * than all lion positions.  In rounds using frontier lists, a chunk
+ * covers entries begin to end - 1 of the list of thread list.
+ */
+struct gentb_chunk {
+	unsigned char ownership, cohort, cohort_end, lionpos, lionpos_end;
+	unsigned list, begin, end;
+};
 
-	/* members not protected by lock */
+/*
+ * This structure is used to coordinate work between the threads.
+ * round_barrier is used to synchronize the threads between rounds.
+ * The member tb contains a pointer to the tablebase we currently work
+ * on.
+ *
+ * Positions marked as won in round r are added to the frontier for
+ * round r + 1.  The frontier for round r is stored in bitmaps[r & 1]
+ * or in the threads' lists[r & 1] depending on mode[r & 1], which is
+ * chosen when round r - 1 is opened.  threads points to an array of
+ * nthreads thread states holding these lists.
+ *
+ * The chunks of work for the current round are found in the array
+ * chunks of length nchunks.  This either points to dense_chunks, an
+ * array of ndense chunks covering the whole encoding space computed
+ * once, or to list_chunks, an array of nlist chunks covering the
+ * frontier lists, recomputed each round it is needed.  list_cap is the
+ * number of chunks allocated for list_chunks.
+ *
+ * The workflow is as follows: At the beginning of each round, all
+ * threads meet at round_barrier.  The last thread to arrive merges the
+ * per-thread win and loss counters into win and loss, prints them, and
+ * opens the next round by selecting the chunks to process and evenly
+ * distributing them over the threads' queues.  If no losses were
+ * found in the previous round, it instead sets done.  All threads then
+ * meet at round_barrier a second time and either terminate or start
+ * taking chunks from their queues.  Once a thread's queue is empty, it
+ * steals half of the remaining work from another thread's queue.  When
+ * all queues are empty, the round ends.  All members of this structure
+ * are only written while opening a round, so no lock is needed.
+ *
+ * If the counting engine is used, counts holds for each position the
+ * number of distinct positions reachable from it that are not known to
+ * be won for the opponent yet.  round_pos points to the
+ * function used to process a frontier position in normal rounds.
+ *
+ * opts points to the options generate_tablebase() was called with.
+ * first_round is the first round to run, which is 1 unless we resume
+ * from a checkpoint.
+ *
+ * If opts->pin is set, each thread is pinned to a CPU and owns a
+ * contiguous range of the table (see owned_range()), which it touches
+ * first so the kernel places these pages on the thread's NUMA node.
+ * The dense chunks are sorted by offset, so the chunks of a range are
+ * adjacent and initially queued to the thread owning it.  Threads
+ * steal from threads on the same node first.
+ */
+struct gentb_state {
 	pthread_barrier_t round_barrier;
 	struct tablebase *tb;
+	atomic_uchar *bitmaps[2], *counts;
+	struct gentb_thread *threads;
+	struct gentb_chunk *chunks, *dense_chunks, *list_chunks;
+	size_t nthreads, nchunks, ndense, nlist, list_cap;
+	const struct gentb_options *opts;
+	unsigned win, loss, first_round;
+	unsigned char mode[2], done;
+	void (*round_pos)(struct gentb_thread *, poscode, int, unsigned *, unsigned *);
+};
+
+/*
+ * Per-thread state.  lists[r & 1] holds the positions this thread
+ * marked for round r if the frontier for round r is stored as lists.
+ * win and loss count the wins and losses this thread found in the
+ * current round.  queue holds the indices of the chunks this thread
+ * has yet to process with the index of the first chunk in the upper
+ * and the index past the last chunk in the lower 32 bits.  It is
+ * modified by compare-and-swap only, as other threads steal from it.
+ * In rounds using the dense chunks, the queue initially holds chunks
+ * dense_first to dense_end - 1.
+ *
+ * cpu and node are the CPU the thread is pinned to and its NUMA node
+ * or -1 and 0 if the thread is not pinned.  positions and busy count
+ * how many positions this thread processed and how many seconds it
+ * spent doing so for the throughput report.
+ *
+ * For the telemetry, scanned, verified, and encoded count how many
+ * positions this thread processed in the current round, how many
+ * positions it checked for being lost, and how often it called
+ * encode_position().  time is the time spent processing chunks and
+ * wait the time spent waiting for the other threads to finish the
+ * round.
+ */
+struct gentb_thread {
+	struct gentb_state *gtbs;
+	struct frontier_list lists[2];
+	atomic_ullong queue;
+	unsigned win, loss, dense_first, dense_end;
+	int cpu, node;
+	unsigned long long positions;
+	double busy;
+	unsigned long long scanned, verified, encoded;
+	double time, wait;
+};
+
+/*
+ * A struct tb_writer describes how the table base is written to f
+ * in write_tablebase() or in the background while count_wdl() is
+ * still running.  compression, block_size, and threads are as for
+ * write_tablebase().  ready is the number of bytes at the beginning
+ * of the table that are final and may be written out, count_wdl()
+ * signals progress whenever it finishes an ownership class.  strm
+ * is the xz encoder if the table base is compressed.  error is the
+ * errno value of the first failure or 0.
+ */
+struct tb_writer {
+	pthread_mutex_t lock;
+	pthread_cond_t progress;
+	FILE *f;
+	const struct tablebase *tb;
+	lzma_stream strm;
+	size_t ready, block_size;
+	int compression, threads, error;
 };
 
+static void	*gentb_worker(void *);
+static void	 open_round(struct gentb_state *, unsigned);
+static size_t	 dense_chunks(struct gentb_chunk *);
+static int	 compare_chunks(const void *, const void *);
+static size_t	 chunk_offset(const struct gentb_chunk *);
+static void	 owned_range(const struct gentb_state *, size_t, size_t *, size_t *);
+static void	 split_dense_chunks(struct gentb_state *);
+static void	 place_thread(struct gentb_thread *);
+static size_t	 cpu_topology(int *, int *);
+#ifdef __linux__
+static int	 read_cpulist(const char *, cpu_set_t *);
+#endif
+static void	 report_nodes(const struct gentb_state *);
+static double	 now(void);
+static size_t	 list_chunks(struct gentb_state *, unsigned);
+static int	 take_chunk(struct gentb_thread *, unsigned *);
+static int	 pop_chunk(atomic_ullong *, unsigned *);
+static int	 steal_chunks(atomic_ullong *, atomic_ullong *);
+static void	 initial_round_chunk(struct gentb_thread *, const struct gentb_chunk *);
+static void	 initial_round_pos(struct gentb_thread *, poscode, unsigned *, unsigned *);
+static void	 bitmap_round_chunk(struct gentb_thread *, const struct gentb_chunk *, unsigned);
+static void	 list_round_chunk(struct gentb_thread *, const struct gentb_chunk *, unsigned);
+static void	 normal_round_pos(struct gentb_thread *, poscode, int, unsigned *, unsigned *);
+static void	 count_round_pos(struct gentb_thread *, poscode, int, unsigned *, unsigned *);
+static void	 mark_loss(struct gentb_thread *, const struct position *, int, unsigned *);
+static unsigned	 count_successors(struct gentb_thread *, const struct position *);
+static void	 encode(struct gentb_thread *, poscode *, const struct position *);
+static void	 mark_position(struct gentb_thread *, const struct position *, tb_entry);
+static void	 add_to_frontier(struct gentb_thread *, size_t, tb_entry);
+static void	 write_checkpoint(struct gentb_state *, unsigned);
+static int	 read_checkpoint(struct gentb_state *, const char *);
+static void	 report_round(const struct gentb_thread *, unsigned);
+static void	 count_wdl(struct tablebase *, FILE *, struct tb_writer *);
+static unsigned	 mark_live(struct tablebase *, poscode);
+static void	 report_histogram(FILE *, const struct tablebase *, poscode);
+static int	 init_writer(struct tb_writer *, FILE *, const struct tablebase *, int, size_t, int);
+static void	 destroy_writer(struct tb_writer *);
+static void	*writer_thread(void *);
+static size_t	 wait_ready(struct tb_writer *, size_t);
+static void	 set_ready(struct tb_writer *, size_t);
+static int	 write_container(struct tb_writer *);
+static int	 emit_live(struct tb_writer *, size_t, size_t, unsigned char *, uint64_t *, size_t *);
+static void	 choose_refs(const struct tablebase *, unsigned *);
+static int	 init_xz(struct tb_writer *);
+static int	 emit(struct tb_writer *, const void *, size_t, lzma_action);
+
 /*
  * This function generates a complete tablebase and returns the
  * generated table base or NULL in case of error with errno containing
  * the reason for failure.  Progress information may be printed to
- * stderr in the process.  The threads argument indicates the number of
+ * stderr in the process.  opts->threads indicates the number of
  * threads used to generate the tablebase.  The number of threads must
- * be positive and not larger than GENTB_MAX_THREADS.
+ * be positive and is clamped to GENTB_MAX_THREADS.  opts->engine
+ * selects the engine used.  The remaining members of opts control
+ * checkpointing, thread placement, telemetry, and writing the table
+ * base out as documented in tablebase.h.
  */
 extern struct tablebase *
-generate_tablebase(int threads)
+generate_tablebase(const struct gentb_options *opts)
 {
 	struct gentb_state gtbs;
-	pthread_t pool[GENTB_MAX_THREADS];
-	int i, j, error;
-
-	if (threads <= 0) {
+	struct gentb_thread gts[GENTB_MAX_THREADS];
+	struct tb_writer writer;
+	pthread_t pool[GENTB_MAX_THREADS], writer_tid;
+	int i, j, error, threads = opts->threads;
+	int cpus[MAX_CPUS], nodes[MAX_CPUS];
+	size_t ncpu = 0;
+
+	if (threads <= 0 || (opts->engine != GENTB_ENGINE_VERIFY
+	    && opts->engine != GENTB_ENGINE_COUNT)
+	    || (opts->checkpoint != NULL && opts->checkpoint_interval == 0)) {
 		errno = EINVAL;
 		return (NULL);
 	}
@@ -101,24 +295,72 @@ generate_tablebase(int threads)
 		threads = GENTB_MAX_THREADS;
 
 	memset(&gtbs, 0, sizeof gtbs);
-	error = pthread_mutex_init(&gtbs.lock, NULL);
+	memset(gts, 0, sizeof gts);
+	error = pthread_barrier_init(&gtbs.round_barrier, NULL, threads);
 	if (error != 0) {
 		errno = error;
 		return (NULL);
 	}
 
-	error = pthread_barrier_init(&gtbs.round_barrier, NULL, threads);
-	if (error != 0) {
-		errno = error;
-		return (NULL);
+	gtbs.opts = opts;
+	gtbs.first_round = 1;
+	gtbs.threads = gts;
+	gtbs.nthreads = threads;
+	gtbs.mode[0] = gtbs.mode[1] = FRONTIER_LIST;
+
+	/*
+	 * calloc() and alloc_tablebase() do not touch large allocations
+	 * unless asked to, so if threads are pinned, the pages are placed
+	 * when the threads touch their ranges in place_thread().
+	 */
+	gtbs.bitmaps[0] = calloc(FRONTIER_BITMAP_SIZE, 1);
+	gtbs.bitmaps[1] = calloc(FRONTIER_BITMAP_SIZE, 1);
+	gtbs.dense_chunks = malloc(MAX_DENSE_CHUNKS * sizeof *gtbs.dense_chunks);
+	gtbs.tb = alloc_tablebase(POSITION_TOTAL_COUNT);
+	if (gtbs.bitmaps[0] == NULL || gtbs.bitmaps[1] == NULL
+	    || gtbs.dense_chunks == NULL || gtbs.tb == NULL)
+		goto fail;
+
+	/* filled in by count_wdl() */
+	gtbs.tb->live.copy = calloc(LIVE_SIZE, 1);
+	if (gtbs.tb->live.copy == NULL)
+		goto fail;
+
+	gtbs.tb->live.bits = gtbs.tb->live.copy;
+
+	if (opts->engine == GENTB_ENGINE_COUNT) {
+		/* all entries used are initialized in the first round */
+		gtbs.counts = malloc(POSITION_TOTAL_COUNT);
+		if (gtbs.counts == NULL)
+			goto fail;
+
+		gtbs.round_pos = count_round_pos;
+	} else
+		gtbs.round_pos = normal_round_pos;
+
+	gtbs.ndense = dense_chunks(gtbs.dense_chunks);
+	qsort(gtbs.dense_chunks, gtbs.ndense, sizeof *gtbs.dense_chunks, compare_chunks);
+
+	if (opts->pin) {
+		ncpu = cpu_topology(cpus, nodes);
+		if (ncpu == 0)
+			fprintf(stderr, "Cannot pin threads on this system\n");
 	}
 
-	gtbs.tb = calloc(POSITION_TOTAL_COUNT, 1);
-	if (gtbs.tb == NULL)
-		return (NULL);
+	for (i = 0; i < threads; i++) {
+		gts[i].cpu = ncpu > 0 ? cpus[i * ncpu / threads] : -1;
+		gts[i].node = ncpu > 0 ? nodes[i * ncpu / threads] : 0;
+	}
+
+	split_dense_chunks(&gtbs);
+
+	/* when resuming, the table is placed while reading the checkpoint */
+	if (opts->resume != NULL && read_checkpoint(&gtbs, opts->resume) != 0)
+		goto fail;
 
 	for (i = 0; i < threads; i++) {
-		error = pthread_create(pool + i, NULL, gentb_worker, (void*)&gtbs);
+		gts[i].gtbs = &gtbs;
+		error = pthread_create(pool + i, NULL, gentb_worker, (void*)(gts + i));
 		/* try to cleanup as much as possible */
 		if (error != 0) {
 			for (j = 0; j < i; j++)
@@ -127,9 +369,8 @@ generate_tablebase(int threads)
 			for (j = 0; j < i; j++)
 				pthread_join(pool[j], NULL);
 
-			free(gtbs.tb);
 			errno = error;
-			return (NULL);
+			goto fail;
 		}
 	}
 
@@ -137,13 +378,69 @@ generate_tablebase(int threads)
 	for (i = 0; i < threads; i++)
 		pthread_join(pool[i], NULL);
 
-	/* print final statistics */
-	fprintf(stderr, "%9u  %9u\n", gtbs.win, gtbs.loss);
+	/*
+	 * count_wdl() is fast enough to do synchronously, but writing
+	 * the table base, especially with compression, is not.  Write
+	 * out each ownership class as soon as count_wdl() is done
+	 * with it.
+	 */
+	if (opts->output == NULL)
+		count_wdl(gtbs.tb, opts->telemetry, NULL);
+	else {
+		if (init_writer(&writer, opts->output, gtbs.tb, opts->compression,
+		    opts->block_size, threads) != 0)
+			goto fail;
+
+		error = pthread_create(&writer_tid, NULL, writer_thread, (void*)&writer);
+		if (error != 0) {
+			destroy_writer(&writer);
+			errno = error;
+			goto fail;
+		}
+
+		count_wdl(gtbs.tb, opts->telemetry, &writer);
+		pthread_join(writer_tid, NULL);
+		destroy_writer(&writer);
+		if (writer.error != 0) {
+			errno = writer.error;
+			goto fail;
+		}
+	}
+
+	if (opts->pin)
+		report_nodes(&gtbs);
 
-	/* this is fast enough to do synchronously */
-	count_wdl(gtbs.tb);
+	for (i = 0; i < threads; i++) {
+		free(gts[i].lists[0].offsets);
+		free(gts[i].lists[1].offsets);
+	}
+
+	free((void*)gtbs.bitmaps[0]);
+	free((void*)gtbs.bitmaps[1]);
+	free(gtbs.dense_chunks);
+	free(gtbs.list_chunks);
+	free((void*)gtbs.counts);
+	pthread_barrier_destroy(&gtbs.round_barrier);
 
 	return (gtbs.tb);
+
+fail:
+	error = errno;
+	for (i = 0; i < threads; i++) {
+		free(gts[i].lists[0].offsets);
+		free(gts[i].lists[1].offsets);
+	}
+
+	free((void*)gtbs.bitmaps[0]);
+	free((void*)gtbs.bitmaps[1]);
+	free(gtbs.dense_chunks);
+	free(gtbs.list_chunks);
+	free((void*)gtbs.counts);
+	free_tablebase(gtbs.tb);
+	pthread_barrier_destroy(&gtbs.round_barrier);
+	errno = error;
+
+	return (NULL);
 }
 
 /*
@@ -152,99 +449,392 @@ generate_tablebase(int threads)
  * general process.
  */
 static void *
-gentb_worker(void *gtbs_arg)
+gentb_worker(void *gt_arg)
 {
-	struct gentb_state *gtbs = gtbs_arg;
-	poscode pc;
-	unsigned round = 1, win = 0, loss = 0, print_stats;
+	struct gentb_thread *gt = gt_arg;
+	struct gentb_state *gtbs = gt->gtbs;
+	const struct gentb_chunk *chunk;
+	unsigned round, index;
 	int error;
+	double start;
+
+	if (gtbs->opts->pin)
+		place_thread(gt);
+
+	for (round = gtbs->first_round;; round++) {
+		start = now();
+		error = pthread_barrier_wait(&gtbs->round_barrier);
+		assert(error == 0 || error == PTHREAD_BARRIER_SERIAL_THREAD);
+		gt->wait = now() - start;
+		if (gtbs->opts->telemetry != NULL && round > gtbs->first_round)
+			report_round(gt, round - 1);
+
+		if (error == PTHREAD_BARRIER_SERIAL_THREAD)
+			open_round(gtbs, round);
+
+		error = pthread_barrier_wait(&gtbs->round_barrier);
+		assert(error == 0 || error == PTHREAD_BARRIER_SERIAL_THREAD);
+		if (gtbs->done)
+			break;
+
+		/* nobody reads the lists we are about to fill anymore */
+		gt->lists[(round + 1) & 1].len = 0;
+		gt->win = gt->loss = 0;
+		gt->scanned = gt->verified = gt->encoded = 0;
+
+		start = now();
+		while (take_chunk(gt, &index)) {
+			chunk = gtbs->chunks + index;
+			if (round == 1)
+				initial_round_chunk(gt, chunk);
+			else if (gtbs->mode[round & 1] == FRONTIER_BITMAP)
+				bitmap_round_chunk(gt, chunk, round);
+			else
+				list_round_chunk(gt, chunk, round);
+		}
 
-	for (;;) {
-		print_stats = 0;
-
-		error = pthread_mutex_lock(&gtbs->lock);
-		assert(error == 0);
-
-		/* are we the first thread to open a new round? */
-		if (round > gtbs->round) {
-			/*
-			 * if we open a round, that means we either just
-			 * waited on round_barrier or we are the first
-			 * thread to run, so we can't have done any work
-			 * before.
-			 */
-			assert(win == 0 && loss == 0);
-
-			win = gtbs->win;
-			loss = gtbs->loss;
-			print_stats = 1;
-
-			/* are we completely done? */
-			if (loss == 0 && gtbs->round > 0) {
-				error = pthread_mutex_unlock(&gtbs->lock);
-				assert(error == 0);
-				break;
+		gt->time = now() - start;
+		gt->busy += gt->time;
+		gt->positions += gt->scanned;
+	}
+
+	return (NULL);
+}
+
+/*
+ * Open round round.  This is called by the last thread to finish the
+ * previous round while all other threads wait for it.  Merge and print
+ * the statistics of the previous round, then prepare the chunks for
+ * this round.  As the number of wins changes only slowly from round to
+ * round, the number of wins in the previous round is used to decide
+ * how to record the frontier for the next round.
+ */
+static void
+open_round(struct gentb_state *gtbs, unsigned round)
+{
+	size_t i, n;
+	unsigned next = (round + 1) & 1;
+
+	gtbs->win = gtbs->loss = 0;
+	for (i = 0; i < gtbs->nthreads; i++) {
+		gtbs->win += gtbs->threads[i].win;
+		gtbs->loss += gtbs->threads[i].loss;
+	}
+
+	if (round > 1) {
+		fprintf(stderr, "%9u  %9u\n", gtbs->win, gtbs->loss);
+
+		/* are we completely done? */
+		if (gtbs->loss == 0) {
+			gtbs->done = 1;
+			return;
+		}
+
+		if (gtbs->opts->checkpoint != NULL
+		    && (round - 1) % gtbs->opts->checkpoint_interval == 0)
+			write_checkpoint(gtbs, round - 1);
+	}
+
+	fprintf(stderr, "Round %2u: ", round);
+
+	if (round == 1 || gtbs->mode[round & 1] == FRONTIER_BITMAP) {
+		gtbs->chunks = gtbs->dense_chunks;
+		gtbs->nchunks = gtbs->ndense;
+	} else {
+		gtbs->nlist = list_chunks(gtbs, round);
+		gtbs->chunks = gtbs->list_chunks;
+		gtbs->nchunks = gtbs->nlist;
+	}
+
+	/*
+	 * distribute chunks evenly, keeping adjacent chunks together.
+	 * Dense chunks go to the threads owning the memory they cover.
+	 */
+	n = gtbs->nchunks;
+	for (i = 0; i < gtbs->nthreads; i++)
+		if (gtbs->chunks == gtbs->dense_chunks)
+			atomic_store(&gtbs->threads[i].queue,
+			    (unsigned long long)gtbs->threads[i].dense_first << 32
+			    | gtbs->threads[i].dense_end);
+		else
+			atomic_store(&gtbs->threads[i].queue,
+			    (unsigned long long)(i * n / gtbs->nthreads) << 32
+			    | (i + 1) * n / gtbs->nthreads);
+
+	/*
+	 * If the bitmap we are about to fill was used in the previous
+	 * round, clear it.  The bitmaps start out cleared.
+	 */
+	if (gtbs->mode[next] == FRONTIER_BITMAP)
+		memset((void*)gtbs->bitmaps[next], 0, FRONTIER_BITMAP_SIZE);
+
+	if (round > 1 && gtbs->win < FRONTIER_LIST_LIMIT)
+		gtbs->mode[next] = FRONTIER_LIST;
+	else
+		gtbs->mode[next] = FRONTIER_BITMAP;
+}
+
+/*
+ * Divide the encoding space into chunks of about CHUNK_TARGET positions
+ * and store them in chunks.  Combinations of ownership and cohort that
+ * are not valid are left out where possible.  Return the number of
+ * chunks generated, which is at most MAX_DENSE_CHUNKS.
+ */
+static size_t
+dense_chunks(struct gentb_chunk *chunks)
+{
+	struct gentb_chunk *c = chunks, batch;
+	poscode pc;
+	unsigned size, step, batch_size;
+
+	for (pc.ownership = 0; pc.ownership < OWNERSHIP_TOTAL_COUNT; pc.ownership++) {
+		batch_size = 0;
+
+		for (pc.cohort = 0; pc.cohort < COHORT_COUNT; pc.cohort++) {
+			if (!has_valid_ownership(pc))
+				continue;
+
+			size = cohort_size[pc.cohort].size * LIONPOS_COUNT;
+
+			/* flush the current batch if it would grow too large */
+			if (batch_size > 0 && batch_size + size > CHUNK_TARGET) {
+				*c++ = batch;
+				batch_size = 0;
+			}
+
+			/* split large cohorts by lion position */
+			if (size >= CHUNK_TARGET) {
+				step = CHUNK_TARGET / cohort_size[pc.cohort].size;
+				if (step == 0)
+					step = 1;
+
+				for (pc.lionpos = 0; pc.lionpos < LIONPOS_COUNT; pc.lionpos += step) {
+					c->ownership = pc.ownership;
+					c->cohort = pc.cohort;
+					c->cohort_end = pc.cohort + 1;
+					c->lionpos = pc.lionpos;
+					c->lionpos_end = pc.lionpos + step < LIONPOS_COUNT ?
+					    pc.lionpos + step : LIONPOS_COUNT;
+					c++;
+				}
+
+				continue;
+			}
+
+			/* batch small cohorts */
+			if (batch_size == 0) {
+				batch.ownership = pc.ownership;
+				batch.cohort = pc.cohort;
+				batch.lionpos = 0;
+				batch.lionpos_end = LIONPOS_COUNT;
 			}
 
-			++gtbs->round;
-			gtbs->win = 0;
-			gtbs->loss = 0;
-			gtbs->pc.ownership = 0;
-			gtbs->pc.cohort = 0;
-		} else {
-			/* report results from previous chunk of work */
-			gtbs->win += win;
-			gtbs->loss += loss;
+			batch.cohort_end = pc.cohort + 1;
+			batch_size += size;
 		}
 
-		assert(round == gtbs->round);
-
-		/* any work left to do? */
-		if (gtbs->pc.ownership == OWNERSHIP_TOTAL_COUNT) {
-			/* wait for more work */
-			error = pthread_mutex_unlock(&gtbs->lock);
-			assert(error == 0);
-			error = pthread_barrier_wait(&gtbs->round_barrier);
-			assert(error == 0 || error == PTHREAD_BARRIER_SERIAL_THREAD);
-			round++;
-			win = loss = 0;
+		if (batch_size > 0)
+			*c++ = batch;
+	}
+
+	assert(c - chunks <= MAX_DENSE_CHUNKS);
+
+	return (c - chunks);
+}
+
+/*
+ * Order chunks by the offset of the first position they cover.
+ */
+static int
+compare_chunks(const void *a, const void *b)
+{
+	size_t x = chunk_offset(a), y = chunk_offset(b);
+
+	return (x < y ? -1 : x > y);
+}
+
+/*
+ * Return the offset of the first position covered by dense chunk c.
+ */
+static size_t
+chunk_offset(const struct gentb_chunk *c)
+{
+	poscode pc;
+
+	pc.ownership = c->ownership;
+	pc.cohort = c->cohort;
+	pc.lionpos = c->lionpos;
+	pc.map = 0;
+
+	return (position_offset(pc));
+}
+
+/*
+ * Compute the range of table offsets from *begin to *end - 1 owned by
+ * thread i.  The part of the table used for valid ownerships is split
+ * evenly, the last thread also owns the unused rest.
+ */
+static void
+owned_range(const struct gentb_state *gtbs, size_t i, size_t *begin, size_t *end)
+{
+
+	*begin = i * POSITION_COUNT / gtbs->nthreads;
+	if (i + 1 == gtbs->nthreads)
+		*end = POSITION_TOTAL_COUNT;
+	else
+		*end = (i + 1) * POSITION_COUNT / gtbs->nthreads;
+}
+
+/*
+ * Decide which dense chunks each thread initially receives.  If threads
+ * are pinned, each thread receives the chunks starting in the range it
+ * owns.  Otherwise the chunks are split evenly.  The dense chunks must
+ * be sorted by offset.
+ */
+static void
+split_dense_chunks(struct gentb_state *gtbs)
+{
+	size_t i, begin, end, chunk = 0, n = gtbs->ndense;
+
+	for (i = 0; i < gtbs->nthreads; i++) {
+		if (!gtbs->opts->pin) {
+			gtbs->threads[i].dense_first = i * n / gtbs->nthreads;
+			gtbs->threads[i].dense_end = (i + 1) * n / gtbs->nthreads;
 			continue;
 		}
 
-		/* take work from gtbs */
-		pc = gtbs->pc;
-		gtbs->pc.cohort++;
-		if (gtbs->pc.cohort == COHORT_COUNT) {
-			gtbs->pc.cohort = 0;
-			gtbs->pc.ownership++;
-		}
+		owned_range(gtbs, i, &begin, &end);
+		gtbs->threads[i].dense_first = chunk;
+		while (chunk < n && chunk_offset(gtbs->dense_chunks + chunk) < end)
+			chunk++;
 
-		error = pthread_mutex_unlock(&gtbs->lock);
-		assert(error == 0);
+		gtbs->threads[i].dense_end = chunk;
+	}
+}
 
-		/*
-		 * do costly IO after releasing the mutex to keep the
-		 * duration we hold the mutex for as short as possible.
-		 */
-		if (print_stats) {
-			if (round > 1)
-				fprintf(stderr, "%9u  %9u\n", win, loss);
+/*
+ * Divide the frontier lists for round into chunks of FRONTIER_CHUNK
+ * entries and store them in gtbs->list_chunks, growing it as needed.
+ * Return the number of chunks generated.
+ */
+static size_t
+list_chunks(struct gentb_state *gtbs, unsigned round)
+{
+	struct gentb_chunk *chunks;
+	const struct frontier_list *fl;
+	size_t i, j, n = 0, cap;
+
+	for (i = 0; i < gtbs->nthreads; i++)
+		n += (gtbs->threads[i].lists[round & 1].len + FRONTIER_CHUNK - 1) / FRONTIER_CHUNK;
+
+	if (n > gtbs->list_cap) {
+		cap = n > 2 * gtbs->list_cap ? n : 2 * gtbs->list_cap;
+		chunks = realloc(gtbs->list_chunks, cap * sizeof *chunks);
+		if (chunks == NULL) {
+			perror("realloc");
+			abort();
+		}
 
-			fprintf(stderr, "Round %2u: ", round);
+		gtbs->list_chunks = chunks;
+		gtbs->list_cap = cap;
+	}
+
+	chunks = gtbs->list_chunks;
+	for (i = 0; i < gtbs->nthreads; i++) {
+		fl = gtbs->threads[i].lists + (round & 1);
+		for (j = 0; j < fl->len; j += FRONTIER_CHUNK) {
+			chunks->list = i;
+			chunks->begin = j;
+			chunks->end = fl->len - j > FRONTIER_CHUNK ? j + FRONTIER_CHUNK : fl->len;
+			chunks++;
 		}
+	}
 
-		/* do the work we have taken */
-		win = loss = 0;
-		if (!has_valid_ownership(pc))
-			continue;
+	return (n);
+}
 
-		if (round == 1)
-			initial_round_chunk(gtbs->tb, pc, &win, &loss);
-		else
-			normal_round_chunk(gtbs->tb, pc, &win, &loss, round);
+/*
+ * Take the index of a chunk to work on and store it in index.  Chunks
+ * are taken from the thread's own queue first.  If that is empty, try
+ * to steal work from the other threads.  Return 1 if a chunk was
+ * found, 0 if no work is left in this round.
+ */
+static int
+take_chunk(struct gentb_thread *gt, unsigned *index)
+{
+	struct gentb_state *gtbs = gt->gtbs;
+	struct gentb_thread *victim;
+	size_t i, self = gt - gtbs->threads;
+	int local;
+
+	for (;;) {
+		if (pop_chunk(&gt->queue, index))
+			return (1);
+
+		/* try threads on the same node first */
+		for (local = 1; local >= 0; local--)
+			for (i = 1; i < gtbs->nthreads; i++) {
+				victim = gtbs->threads + (self + i) % gtbs->nthreads;
+				if ((victim->node == gt->node) != local)
+					continue;
+
+				if (steal_chunks(&victim->queue, &gt->queue))
+					goto stolen;
+			}
+
+		return (0);
+
+	stolen:
+		;
 	}
+}
 
-	return (NULL);
+/*
+ * Take the first chunk from queue and store its index in index.
+ * Return 1 on success, 0 if the queue was empty.
+ */
+static int
+pop_chunk(atomic_ullong *queue, unsigned *index)
+{
+	unsigned long long q = atomic_load(queue);
+	unsigned first, end;
+
+	for (;;) {
+		first = q >> 32;
+		end = q & 0xffffffffU;
+		if (first >= end)
+			return (0);
+
+		if (atomic_compare_exchange_strong(queue, &q, (unsigned long long)(first + 1) << 32 | end)) {
+			*index = first;
+			return (1);
+		}
+	}
+}
+
+/*
+ * Steal the second half of the chunks in victim and place them in
+ * queue, which is assumed to be empty.  Return 1 on success, 0 if
+ * victim was empty.
+ */
+static int
+steal_chunks(atomic_ullong *victim, atomic_ullong *queue)
+{
+	unsigned long long q = atomic_load(victim);
+	unsigned first, end, mid;
+
+	for (;;) {
+		first = q >> 32;
+		end = q & 0xffffffffU;
+		if (first >= end)
+			return (0);
+
+		mid = end - (end - first + 1) / 2;
+		if (atomic_compare_exchange_strong(victim, &q, (unsigned long long)first << 32 | mid)) {
+			atomic_store(queue, (unsigned long long)mid << 32 | end);
+			return (1);
+		}
+	}
 }
 
 /*
@@ -257,29 +847,47 @@ gentb_worker(void *gtbs_arg)
  *  - mate-in-one positions (2) if a checkmate can be reached.
  */
 static void
-initial_round_chunk(struct tablebase *tb, poscode pc, unsigned *win, unsigned *loss)
+initial_round_chunk(struct gentb_thread *gt, const struct gentb_chunk *c)
 {
-	unsigned size = cohort_size[pc.cohort].size;
+	poscode pc;
+	unsigned size;
 
-	for (pc.lionpos = 0; pc.lionpos < LIONPOS_COUNT; pc.lionpos++)
-		for (pc.map = 0; pc.map < size; pc.map++)
-			initial_round_pos(tb, pc, win, loss);
+	pc.ownership = c->ownership;
+	for (pc.cohort = c->cohort; pc.cohort < c->cohort_end; pc.cohort++) {
+		if (!has_valid_ownership(pc))
+			continue;
+
+		size = cohort_size[pc.cohort].size;
+		for (pc.lionpos = c->lionpos; pc.lionpos < c->lionpos_end; pc.lionpos++)
+			for (pc.map = 0; pc.map < size; pc.map++)
+				initial_round_pos(gt, pc, &gt->win, &gt->loss);
+
+		gt->scanned += size * (c->lionpos_end - c->lionpos);
+	}
 }
 
 /*
  * For the initial round, evaluate one position indicated by pc and
  * store the result in tb.  Also increment win1 and loss1 if an
- * immediate win or checkmate is encountered.
+ * immediate win or checkmate is encountered.  For the counting engine,
+ * also initialize the position's entry in counts.  If pc is not
+ * canonical (see is_canonical()), its entry is left at 0 as it is
+ * never looked up.  count_wdl() erases it at the end.
  */
 static void
-initial_round_pos(struct tablebase *tb, poscode pc, unsigned *win1, unsigned *loss1)
+initial_round_pos(struct gentb_thread *gt, poscode pc, unsigned *win1, unsigned *loss1)
 {
+	struct tablebase *tb = gt->gtbs->tb;
 	struct position p;
 	struct unmove unmoves[MAX_UNMOVES];
 	struct move moves[MAX_MOVES];
 	size_t i, nmove, offset = position_offset(pc);
+	unsigned count;
 	int game_ended;
 
+	if (!is_canonical(pc))
+		return;
+
 	decode_poscode(&p, pc);
 	if (gote_in_check(&p)) {
 		tb->positions[offset] = 1;
@@ -287,15 +895,23 @@ initial_round_pos(struct tablebase *tb, poscode pc, unsigned *win1, unsigned *lo
 		return;
 	}
 
-	nmove = generate_moves(moves, &p);
-	for (i = 0; i < nmove; i++) {
-		struct position pp = p;
-		game_ended = play_move(&pp, moves + i);
-		assert(!game_ended);
-
-		if (!sente_in_check(&pp)) {
-			/* position is not an immediate loss, can't judge it */
+	++gt->verified;
+	if (gt->gtbs->counts != NULL) {
+		count = count_successors(gt, &p);
+		gt->gtbs->counts[offset] = count;
+		if (count > 0)
 			return;
+	} else {
+		nmove = generate_moves(moves, &p);
+		for (i = 0; i < nmove; i++) {
+			struct position pp = p;
+			game_ended = play_move(&pp, moves + i);
+			assert(!game_ended);
+
+			if (!sente_in_check(&pp)) {
+				/* position is not an immediate loss, can't judge it */
+				return;
+			}
 		}
 	}
 
@@ -313,7 +929,7 @@ initial_round_pos(struct tablebase *tb, poscode pc, unsigned *win1, unsigned *lo
 		 * positions that are also mate in 1.
 		 */
 		if (!sente_in_check(&pp))
-			mark_position(tb, &pp, 2);
+			mark_position(gt, &pp, 2);
 	}
 }
 
@@ -323,51 +939,95 @@ initial_round_pos(struct tablebase *tb, poscode pc, unsigned *win1, unsigned *lo
  * each position we find this way, we check if it's a losing position.
  * If it is, we mark the position as "lost" with the appropriate
  * distance to mate and every position reachable unmarked positions from
- * this as "won" with the appropriate distance to mate. If any positions
- * were marked in this last phase, nonzero is returned, zero otherwise.
+ * this as "won" with the appropriate distance to mate.
+ *
+ * This function processes the positions in the frontier bitmap that
+ * belong to chunk c.
  */
 static void
-normal_round_chunk(struct tablebase *tb, poscode pc, unsigned *win, unsigned *loss, unsigned round)
+bitmap_round_chunk(struct gentb_thread *gt, const struct gentb_chunk *c, unsigned round)
 {
-	unsigned size = cohort_size[pc.cohort].size;
+	const atomic_uchar *bitmap = gt->gtbs->bitmaps[round & 1];
+	poscode pc;
+	size_t offset, begin, end, size;
 
-	for (pc.lionpos = 0; pc.lionpos < LIONPOS_COUNT; pc.lionpos++)
-		for (pc.map = 0; pc.map < size; pc.map++)
-			normal_round_pos(tb, pc, round, win, loss);
+	pc.ownership = c->ownership;
+	for (pc.cohort = c->cohort; pc.cohort < c->cohort_end; pc.cohort++) {
+		if (!has_valid_ownership(pc))
+			continue;
+
+		size = cohort_size[pc.cohort].size;
+		pc.lionpos = c->lionpos;
+		pc.map = 0;
+		begin = position_offset(pc);
+		end = begin + size * (c->lionpos_end - c->lionpos);
+
+		for (offset = begin; offset < end; offset++) {
+			/* skip over empty parts of the bitmap quickly */
+			if (offset % CHAR_BIT == 0) {
+				offset = CHAR_BIT * scan_nonzero(bitmap, offset / CHAR_BIT,
+				    (end + CHAR_BIT - 1) / CHAR_BIT);
+				if (offset >= end)
+					break;
+			}
+
+			if (!(bitmap[offset / CHAR_BIT] & 1 << offset % CHAR_BIT))
+				continue;
+
+			pc.lionpos = c->lionpos + (offset - begin) / size;
+			pc.map = (offset - begin) % size;
+			gt->gtbs->round_pos(gt, pc, round, &gt->win, &gt->loss);
+		}
+	}
+}
+
+/*
+ * Like bitmap_round_chunk(), but process the positions in the slice of
+ * a frontier list described by chunk c.
+ */
+static void
+list_round_chunk(struct gentb_thread *gt, const struct gentb_chunk *c, unsigned round)
+{
+	const struct frontier_list *fl = gt->gtbs->threads[c->list].lists + (round & 1);
+	size_t i;
+
+	for (i = c->begin; i < c->end; i++)
+		gt->gtbs->round_pos(gt, offset_poscode(fl->offsets[i]), round, &gt->win, &gt->loss);
 }
 
 /*
  * Process one position in a normal round.
  */
 static void
-normal_round_pos(struct tablebase *tb, poscode pc, int round,
+normal_round_pos(struct gentb_thread *gt, poscode pc, int round,
     unsigned *wins, unsigned *losses)
 {
+	struct tablebase *tb = gt->gtbs->tb;
 	struct position p;
 	struct unmove unmoves[MAX_UNMOVES];
 	size_t i, nunmove;
 
-	if (tb->positions[position_offset(pc)] != round)
-		return;
+	/* only positions won in this round are in the frontier */
+	assert(tb->positions[position_offset(pc)] == round);
 
 	++*wins;
+	++gt->scanned;
 
 	decode_poscode(&p, pc);
 	nunmove = generate_unmoves(unmoves, &p);
 	for (i = 0; i < nunmove; i++) {
 		/* check if this is indeed a losing position */
-		struct position ppmirror, pp = p;
+		struct position pp = p;
 		poscode pc;
-		struct unmove ununmoves[MAX_UNMOVES];
 		struct move moves[MAX_MOVES];
 		tb_entry value;
-		size_t j, nununmove, nmove, offset;
+		size_t j, nmove, offset;
 		int game_ends;
 
 		undo_move(&pp, unmoves + i);
 
 		/* have we already analyzed this position? */
-		encode_position(&pc, &pp);
+		encode(gt, &pc, &pp);
 		if (pc.lionpos >= LIONPOS_COUNT)
 			continue;
 
@@ -375,6 +1035,8 @@ normal_round_pos(struct tablebase *tb, poscode pc, int round,
 		if (tb->positions[offset] != 0)
 			continue;
 
+		++gt->verified;
+
 		/* make sure all moves are losing */
 		nmove = generate_moves(moves, &pp);
 		for (j = 0; j < nmove; j++) {
@@ -387,38 +1049,14 @@ normal_round_pos(struct tablebase *tb, poscode pc, int round,
 			if (gote_in_check(&ppp))
 				continue;
 
-			encode_position(&pppc, &ppp);
+			encode(gt, &pppc, &ppp);
 			value = tb->positions[position_offset(pppc)];
 			if (!is_win(value) || value > round)
 				goto not_a_losing_position;
 		}
 
-		/* all moves are losing, mark positions as lost */
-		value = atomic_exchange(tb->positions + offset, -round);
-		assert(value == 0 || value == -round);
-		if (value == 0)
-			++*losses;
-
-		ppmirror = pp;
-		if (position_mirror(&ppmirror)) {
-			encode_position(&pc, &ppmirror);
-			offset = position_offset(pc);
-			value = atomic_exchange(tb->positions + offset, -round);
-			assert(value == 0 || value == -round);
-			if (value == 0)
-				++*losses;
-		}
-
-		/* mark all positions reachable from this one as won */
-		nununmove = generate_unmoves(ununmoves, &pp);
-		for (j = 0; j < nununmove; j++) {
-			struct position ppp = pp;
-
-			undo_move(&ppp, ununmoves + j);
-
-			if (!gote_in_check(&ppp))
-				mark_position(tb, &ppp, round + 1);
-		}
+		/* all moves are losing */
+		mark_loss(gt, &pp, round, losses);
 
 	not_a_losing_position:
 		;
@@ -426,93 +1064,1043 @@ normal_round_pos(struct tablebase *tb, poscode pc, int round,
 }
 
 /*
- * Mark position p and its mirrored variant as e in tb if it hasn't been
- * marked before.
+ * Process one position in a normal round of the counting engine.  For
+ * each distinct position that has a move to pc, decrement the count of
+ * moves not known to lead to a win for the opponent.  If it drops to
+ * zero, all moves are losing and the position is lost.
  */
 static void
-mark_position(struct tablebase *tb, const struct position *p, tb_entry e)
+count_round_pos(struct gentb_thread *gt, poscode pc, int round,
+    unsigned *wins, unsigned *losses)
 {
-	struct position pp = *p;
-	poscode pc;
-	size_t offset;
+	struct tablebase *tb = gt->gtbs->tb;
+	atomic_uchar *counts = gt->gtbs->counts;
+	struct position p, preds[MAX_UNMOVES];
+	struct unmove unmoves[MAX_UNMOVES];
+	size_t i, j, offset, npred = 0, nunmove, offsets[MAX_UNMOVES];
 
-	encode_position(&pc, &pp);
 	offset = position_offset(pc);
-	assert(tb->positions[offset] >= 0);
+	assert(tb->positions[offset] == round);
 
-	/*
-	 * We only use this function to mark positions as won.  Thus,
-	 * other threads might only attempt to concurrently mark this
-	 * position as e and we don't have a test-and-set style race
-	 * condition.
-	 */
-	if (tb->positions[offset] != 0)
-		return;
+	++*wins;
+	++gt->scanned;
 
-	tb->positions[offset] = e;
+	decode_poscode(&p, pc);
 
-	if (!position_mirror(&pp))
-		return;
+	/* find all distinct predecessors not yet known to be won or lost */
+	nunmove = generate_unmoves(unmoves, &p);
+	for (i = 0; i < nunmove; i++) {
+		struct position pp = p;
+
+		undo_move(&pp, unmoves + i);
+		encode(gt, &pc, &pp);
+		if (pc.lionpos >= LIONPOS_COUNT)
+			continue;
 
-	encode_position(&pc, &pp);
+		offset = position_offset(pc);
+		if (tb->positions[offset] != 0)
+			continue;
+
+		for (j = 0; j < npred; j++)
+			if (offsets[j] == offset)
+				break;
+
+		if (j == npred) {
+			offsets[npred] = offset;
+			preds[npred++] = pp;
+		}
+	}
+
+	gt->verified += npred;
+	for (i = 0; i < npred; i++)
+		if (atomic_fetch_sub(counts + offsets[i], 1) == 1)
+			mark_loss(gt, preds + i, round, losses);
+}
+
+/*
+ * Mark position p as lost in round round and increment losses if it
+ * was not marked before.  Then mark all positions from which
+ * p can be reached as won.
+ */
+static void
+mark_loss(struct gentb_thread *gt, const struct position *p, int round,
+    unsigned *losses)
+{
+	struct tablebase *tb = gt->gtbs->tb;
+	struct unmove unmoves[MAX_UNMOVES];
+	poscode pc;
+	tb_entry value;
+	size_t i, nunmove;
+
+	encode(gt, &pc, p);
+	value = atomic_exchange(tb->positions + position_offset(pc), -round);
+	assert(value == 0 || value == -round);
+	if (value == 0)
+		++*losses;
+
+	/* mark all positions reachable from this one as won */
+	nunmove = generate_unmoves(unmoves, p);
+	for (i = 0; i < nunmove; i++) {
+		struct position ppp = *p;
+
+		undo_move(&ppp, unmoves + i);
+
+		if (!gote_in_check(&ppp))
+			mark_position(gt, &ppp, round + 1);
+	}
+}
+
+/*
+ * Return the number of distinct positions reachable from p that are not
+ * immediate wins for the opponent.
+ */
+static unsigned
+count_successors(struct gentb_thread *gt, const struct position *p)
+{
+	struct move moves[MAX_MOVES];
+	poscode pc;
+	size_t i, j, nmove, noffset = 0, offset, offsets[MAX_MOVES];
+	int game_ended;
+
+	nmove = generate_moves(moves, p);
+	for (i = 0; i < nmove; i++) {
+		struct position pp = *p;
+
+		game_ended = play_move(&pp, moves + i);
+		assert(!game_ended);
+		if (sente_in_check(&pp))
+			continue;
+
+		encode(gt, &pc, &pp);
+		offset = position_offset(pc);
+		for (j = 0; j < noffset; j++)
+			if (offsets[j] == offset)
+				break;
+
+		if (j == noffset)
+			offsets[noffset++] = offset;
+	}
+
+	return (noffset);
+}
+
+/*
+ * Encode p into pc, counting the call for the telemetry.
+ */
+static void
+encode(struct gentb_thread *gt, poscode *pc, const struct position *p)
+{
+
+	gt->encoded++;
+	encode_position(pc, p);
+}
+
+/*
+ * Mark position p as e in tb if it hasn't been marked before.  Add the
+ * position to the frontier for round e if it was marked.
+ */
+static void
+mark_position(struct gentb_thread *gt, const struct position *p, tb_entry e)
+{
+	struct tablebase *tb = gt->gtbs->tb;
+	poscode pc;
+	size_t offset;
+
+	encode(gt, &pc, p);
 	offset = position_offset(pc);
 	assert(tb->positions[offset] >= 0);
 
+	/*
+	 * We only use this function to mark positions as won.  Thus,
+	 * other threads might only attempt to concurrently mark this
+	 * position as e and we don't have a test-and-set style race
+	 * condition.  The atomic exchange makes sure that only one
+	 * thread adds the position to the frontier.
+	 */
 	if (tb->positions[offset] != 0)
 		return;
 
-	tb->positions[offset] = e;
+	if (atomic_exchange(tb->positions + offset, e) == 0)
+		add_to_frontier(gt, offset, e);
+}
+
+/*
+ * Add the position at offset to the frontier for round round.  Lists
+ * are grown as needed.  Failure to do so is fatal as the position
+ * would otherwise be lost from the frontier.
+ */
+static void
+add_to_frontier(struct gentb_thread *gt, size_t offset, tb_entry round)
+{
+	struct frontier_list *fl;
+	unsigned *offsets;
+	size_t cap;
+
+	if (gt->gtbs->mode[round & 1] == FRONTIER_BITMAP) {
+		atomic_fetch_or(gt->gtbs->bitmaps[round & 1] + offset / CHAR_BIT,
+		    1 << offset % CHAR_BIT);
+		return;
+	}
+
+	fl = gt->lists + (round & 1);
+	if (fl->len == fl->cap) {
+		cap = fl->cap == 0 ? FRONTIER_CHUNK : 2 * fl->cap;
+		offsets = realloc(fl->offsets, cap * sizeof *offsets);
+		if (offsets == NULL) {
+			perror("realloc");
+			abort();
+		}
+
+		fl->offsets = offsets;
+		fl->cap = cap;
+	}
+
+	fl->offsets[fl->len++] = offset;
+}
+
+/*
+ * Pin the calling thread to gt->cpu if possible and touch the part of
+ * the table, the counts, and the bitmaps it owns so they are placed on
+ * its NUMA node.  If we resumed from a checkpoint, the table has
+ * already been written and is not touched again.
+ */
+static void
+place_thread(struct gentb_thread *gt)
+{
+	struct gentb_state *gtbs = gt->gtbs;
+	size_t begin, end;
+#ifdef __linux__
+	cpu_set_t set;
+	int error;
+
+	if (gt->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(gt->cpu, &set);
+		error = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+		if (error != 0)
+			fprintf(stderr, "Cannot pin thread to CPU %d: %s\n",
+			    gt->cpu, strerror(error));
+	}
+#endif
+
+	if (gtbs->opts->resume != NULL)
+		return;
+
+	owned_range(gtbs, gt - gtbs->threads, &begin, &end);
+	memset((void*)(gtbs->tb->positions + begin), 0, end - begin);
+	if (gtbs->counts != NULL)
+		memset((void*)(gtbs->counts + begin), 0, end - begin);
+
+	begin /= CHAR_BIT;
+	end = end == POSITION_TOTAL_COUNT ? FRONTIER_BITMAP_SIZE : end / CHAR_BIT;
+	memset((void*)(gtbs->bitmaps[0] + begin), 0, end - begin);
+	memset((void*)(gtbs->bitmaps[1] + begin), 0, end - begin);
+}
+
+/*
+ * Find the CPUs we may run on and the NUMA nodes they belong to.  Store
+ * up to MAX_CPUS CPU numbers in cpus and the corresponding node numbers
+ * in nodes, sorted by node.  CPUs whose node cannot be determined are
+ * assumed to belong to node 0.  Return the number of CPUs found or 0 if
+ * this information is not available on this system.
+ */
+static size_t
+cpu_topology(int *cpus, int *nodes)
+{
+#ifdef __linux__
+	cpu_set_t allowed, online, nodecpus, seen;
+	size_t n = 0;
+	int cpu, node;
+	char path[64];
+
+	if (sched_getaffinity(0, sizeof allowed, &allowed) != 0)
+		return (0);
+
+	CPU_ZERO(&seen);
+
+	/* node numbers are listed in the same format as CPU numbers */
+	if (read_cpulist("/sys/devices/system/node/online", &online) == 0)
+		for (node = 0; node < MAX_NODES; node++) {
+			if (!CPU_ISSET(node, &online))
+				continue;
+
+			sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+			if (read_cpulist(path, &nodecpus) != 0)
+				continue;
+
+			for (cpu = 0; cpu < CPU_SETSIZE && n < MAX_CPUS; cpu++)
+				if (CPU_ISSET(cpu, &nodecpus) && CPU_ISSET(cpu, &allowed)
+				    && !CPU_ISSET(cpu, &seen)) {
+					CPU_SET(cpu, &seen);
+					cpus[n] = cpu;
+					nodes[n++] = node;
+				}
+		}
+
+	/* CPUs not found in any node */
+	for (cpu = 0; cpu < CPU_SETSIZE && n < MAX_CPUS; cpu++)
+		if (CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &seen)) {
+			cpus[n] = cpu;
+			nodes[n++] = 0;
+		}
+
+	return (n);
+#else
+	(void)cpus;
+	(void)nodes;
+
+	return (0);
+#endif
+}
+
+#ifdef __linux__
+/*
+ * Read a list of CPUs in the format used by Linux' sysfs (e.g.
+ * 0-3,8-11) from file path into set.  Return 0 on success, -1 on
+ * failure.
+ */
+static int
+read_cpulist(const char *path, cpu_set_t *set)
+{
+	FILE *f;
+	int lo, hi, c;
+
+	CPU_ZERO(set);
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return (-1);
+
+	while (fscanf(f, "%d", &lo) == 1) {
+		hi = lo;
+		c = getc(f);
+		if (c == '-') {
+			if (fscanf(f, "%d", &hi) != 1)
+				break;
+
+			c = getc(f);
+		}
+
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+			if (lo >= 0)
+				CPU_SET(lo, set);
+
+		if (c != ',')
+			break;
+	}
+
+	fclose(f);
+
+	return (0);
+}
+#endif
+
+/*
+ * Print how many positions the threads of each NUMA node processed
+ * and how many positions per second they processed together.
+ */
+static void
+report_nodes(const struct gentb_state *gtbs)
+{
+	const struct gentb_thread *gt;
+	unsigned long long positions;
+	double busy;
+	size_t i, threads;
+	int node;
+
+	for (node = 0; node < MAX_NODES; node++) {
+		positions = 0;
+		busy = 0.0;
+		threads = 0;
+		for (i = 0; i < gtbs->nthreads; i++) {
+			gt = gtbs->threads + i;
+			if (gt->node != node)
+				continue;
+
+			positions += gt->positions;
+			busy += gt->busy;
+			threads++;
+		}
+
+		if (threads == 0)
+			continue;
+
+		fprintf(stderr, "Node %2d: %2zu threads  %11llu positions  %11.0f positions/s\n",
+		    node, threads, positions, busy > 0.0 ? positions * threads / busy : 0.0);
+	}
+}
+
+/*
+ * Write a telemetry record describing what gt did in round round.
+ * barrier_wait is the time gt waited for the other threads at the end
+ * of the round.
+ */
+static void
+report_round(const struct gentb_thread *gt, unsigned round)
+{
+	struct rusage ru;
+	long maxrss = 0;
+
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		maxrss = ru.ru_maxrss;
+
+	/* a single fprintf() call so records of different threads do not mix */
+	fprintf(gt->gtbs->opts->telemetry,
+	    "{\"type\":\"round\",\"round\":%u,\"thread\":%zu,\"time\":%.6f,"
+	    "\"scanned\":%llu,\"verified\":%llu,\"encodes\":%llu,"
+	    "\"wins\":%u,\"losses\":%u,\"barrier_wait\":%.6f,\"peak_rss_kb\":%ld}\n",
+	    round, (size_t)(gt - gt->gtbs->threads), gt->time,
+	    gt->scanned, gt->verified, gt->encoded,
+	    gt->win, gt->loss, gt->wait, maxrss);
+}
+
+/*
+ * Return the current time in seconds from some arbitrary epoch.
+ */
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Save the state of the generator after round round to the checkpoint
+ * file.  The checkpoint is first written to a temporary file which is
+ * then renamed over the checkpoint, so an interruption never leaves a
+ * partial checkpoint behind.  The checkpoint consists of a header line
+ * holding the format version, the engine, the round, and the number of
+ * wins and losses found in that round, followed by the table and, for
+ * the counting engine, the counts.  The frontier is not saved as it
+ * can be recovered from the table.  Failure to write a checkpoint is
+ * reported, but not fatal.
+ */
+static void
+write_checkpoint(struct gentb_state *gtbs, unsigned round)
+{
+	FILE *f;
+	const char *path = gtbs->opts->checkpoint;
+	char *tmp;
+
+	tmp = malloc(strlen(path) + sizeof ".tmp");
+	if (tmp == NULL) {
+		perror(path);
+		return;
+	}
+
+	strcpy(tmp, path);
+	strcat(tmp, ".tmp");
+
+	f = fopen(tmp, "wb");
+	if (f == NULL) {
+		perror(tmp);
+		free(tmp);
+		return;
+	}
+
+	fprintf(f, "gentb checkpoint %d %d %u %u %u %lu\n", CHECKPOINT_VERSION,
+	    gtbs->opts->engine, round, gtbs->win, gtbs->loss,
+	    (unsigned long)POSITION_TOTAL_COUNT);
+	fwrite((void*)gtbs->tb->positions, POSITION_TOTAL_COUNT, 1, f);
+	if (gtbs->counts != NULL)
+		fwrite((void*)gtbs->counts, POSITION_TOTAL_COUNT, 1, f);
+
+	if (fflush(f) != 0 || ferror(f) || fsync(fileno(f)) != 0) {
+		perror(tmp);
+		fclose(f);
+		goto fail;
+	}
+
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		perror(tmp);
+		goto fail;
+	}
+
+	free(tmp);
+	return;
+
+fail:
+	unlink(tmp);
+	free(tmp);
+}
+
+/*
+ * Restore the state of the generator from the checkpoint in file path
+ * written by write_checkpoint().  The frontier for the next round is
+ * recovered by collecting all positions won in that round into a
+ * bitmap.  The win and loss figures of the checkpointed round are
+ * attributed to the first thread so they are reported again when the
+ * next round is opened.  Return 0 on success, -1 on failure with errno
+ * set to the reason for failure.  A malformed checkpoint or one written
+ * for a different engine is reported as EINVAL.
+ */
+static int
+read_checkpoint(struct gentb_state *gtbs, const char *path)
+{
+	FILE *f;
+	unsigned long size;
+	unsigned round, win, loss;
+	int version, engine, error;
+	char line[128];
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return (-1);
+
+	if (fgets(line, sizeof line, f) == NULL
+	    || sscanf(line, "gentb checkpoint %d %d %u %u %u %lu",
+	    &version, &engine, &round, &win, &loss, &size) != 6
+	    || version != CHECKPOINT_VERSION || engine != gtbs->opts->engine
+	    || round == 0 || round >= SCHAR_MAX || size != POSITION_TOTAL_COUNT)
+		goto invalid;
+
+	if (fread((void*)gtbs->tb->positions, POSITION_TOTAL_COUNT, 1, f) != 1)
+		goto invalid;
+
+	if (gtbs->counts != NULL
+	    && fread((void*)gtbs->counts, POSITION_TOTAL_COUNT, 1, f) != 1)
+		goto invalid;
+
+	fclose(f);
+
+	scan_equal(gtbs->tb->positions, POSITION_TOTAL_COUNT, round + 1,
+	    gtbs->bitmaps[(round + 1) & 1]);
+
+	gtbs->mode[(round + 1) & 1] = FRONTIER_BITMAP;
+	gtbs->first_round = round + 1;
+	gtbs->threads[0].win = win;
+	gtbs->threads[0].loss = loss;
+
+	fprintf(stderr, "Round %2u: ", round);
+
+	return (0);
+
+invalid:
+	error = ferror(f) ? EIO : EINVAL;
+	fclose(f);
+	errno = error;
+
+	return (-1);
 }
 
 /*
  * Count how many positions are wins, draws, and losses and print the
- * figures to stderr.  Also erase all invalid and mate positions from
- * the table base and overwrite them with the most common value (2) as
- * we never read them again.
+ * figures to stderr.  Also erase all invalid and mate positions as well
+ * as the entries of poscodes that are not canonical from the table
+ * base and overwrite them with the most common value (2) as we never
+ * read them again, and fill in the live bitmap of tb.  If telemetry
+ * is not NULL, first write a histogram of the distance to mate of
+ * every cohort to it.  The table base is processed in the order of
+ * ownership classes in memory.  If writer is not NULL, it is told
+ * whenever an ownership class is finished.
  */
 static void
-count_wdl(struct tablebase *tb)
+count_wdl(struct tablebase *tb, FILE *telemetry, struct tb_writer *writer)
 {
 	poscode pc;
-	size_t offset;
-	unsigned size, win = 0, draw = 0, loss = 0;
-	tb_entry e;
+	size_t class;
+	unsigned size, ntwin, win = 0, draw = 0, loss = 0;
 
-	for (pc.ownership = 0; pc.ownership < OWNERSHIP_TOTAL_COUNT; pc.ownership++)
+	/* the positions of a cohort are contiguous */
+	for (class = 0; class < OWNERSHIP_TOTAL_COUNT; class++) {
+		pc = offset_poscode(class * (POSITION_TOTAL_COUNT / OWNERSHIP_TOTAL_COUNT));
 		for (pc.cohort = 0; pc.cohort < COHORT_COUNT; pc.cohort++) {
 			size = cohort_size[pc.cohort].size;
+			pc.lionpos = pc.map = 0;
 			if (!has_valid_ownership(pc)) {
-				pc.lionpos = pc.map = 0;
 				memset((char*)tb->positions + position_offset(pc), 2, size * LIONPOS_COUNT);
-			} else for (pc.lionpos = 0; pc.lionpos < LIONPOS_COUNT; pc.lionpos++)
-				for (pc.map = 0; pc.map < size; pc.map++) {
-					offset = position_offset(pc);					
-					e = tb->positions[offset];
-					if (is_win(e))
-						win++;
-					else if (is_loss(e))
-						loss++;
-					else /* is_draw(e) */
-						draw++;
-					if (e == 1)
-						tb->positions[offset] = 2;
-				}
+				continue;
+			}
+
+			ntwin = mark_live(tb, pc);
+			if (telemetry != NULL)
+				report_histogram(telemetry, tb, pc);
+
+			/* the erased twins are not positions of their own */
+			scan_wdl(tb->positions + position_offset(pc), size * LIONPOS_COUNT,
+			    &win, &loss, &draw);
+			win -= ntwin;
 		}
 
+		/* the byte of the live bitmap at the end may not be done yet */
+		if (writer != NULL && class + 1 < OWNERSHIP_COUNT)
+			set_ready(writer, (class + 1) * TB_SECTION_SIZE / 8 * 8);
+		else if (writer != NULL && class + 1 == OWNERSHIP_COUNT)
+			set_ready(writer, POSITION_COUNT);
+	}
+
 	fprintf(stderr, "Total:    %9u  %9u  %9u\n", win, loss, draw);
 }
 
 /*
- * Write tb to file f.  It is assumed that f has been opened in binary
- * mode for writing and truncated.  This function returns 0 on success,
- * -1 on error with errno indicating the reason for failure.
+ * Overwrite the entries of the poscodes in the cohort of pc that are
+ * not canonical with 2 and return how many there are.  Mark the other
+ * positions of the cohort as live in tb unless they are checkmates,
+ * which still have the entry 1 initial_round_pos() gave them, or the
+ * cohort is not stored in the table base file.
+ */
+static unsigned
+mark_live(struct tablebase *tb, poscode pc)
+{
+	unsigned char *live = tb->live.copy;
+	size_t offset;
+	unsigned size = cohort_size[pc.cohort].size, ntwin = 0;
+
+	for (pc.lionpos = 0; pc.lionpos < LIONPOS_COUNT; pc.lionpos++)
+		for (pc.map = 0; pc.map < size; pc.map++) {
+			offset = position_offset(pc);
+			if (!is_canonical(pc)) {
+				tb->positions[offset] = 2;
+				ntwin++;
+			} else if (offset < POSITION_COUNT && tb->positions[offset] != 1)
+				live[offset / 8] |= 1 << offset % 8;
+		}
+
+	return (ntwin);
+}
+
+/*
+ * Write a histogram of the entries in the cohort of pc to telemetry.
+ * Only entries that occur at least once are written.
+ */
+static void
+report_histogram(FILE *telemetry, const struct tablebase *tb, poscode pc)
+{
+	const atomic_schar *entries = tb->positions + position_offset(pc);
+	size_t i, size = cohort_size[pc.cohort].size * LIONPOS_COUNT;
+	unsigned long long histogram[UCHAR_MAX + 1] = { 0 };
+	int value;
+	const char *sep = "";
+
+	for (i = 0; i < size; i++)
+		histogram[(unsigned char)entries[i]]++;
+
+	fprintf(telemetry, "{\"type\":\"histogram\",\"ownership\":%u,\"cohort\":%u,\"dtm\":{",
+	    (unsigned)pc.ownership, (unsigned)pc.cohort);
+	for (value = SCHAR_MIN; value <= SCHAR_MAX; value++) {
+		if (histogram[(unsigned char)value] == 0)
+			continue;
+
+		fprintf(telemetry, "%s\"%d\":%llu", sep, value, histogram[(unsigned char)value]);
+		sep = ",";
+	}
+
+	fprintf(telemetry, "}}\n");
+}
+
+/*
+ * Write tb to file f as a container with a header and an index (see
+ * tbformat.c).  It is assumed that f has been opened in binary mode
+ * for writing and truncated.  compression is either
+ * TB_UNCOMPRESSED or an xz preset level between 0 and 9, optionally
+ * or'ed with TB_XZ_EXTREME and TB_XZ_PREDICT.  With TB_XZ_PREDICT, the
+ * live bitmap of each section is stored predicted from a similar
+ * section (see tbformat.c).  If the table is compressed, it is split
+ * into blocks of block_size bytes that are compressed independently by
+ * up to threads threads.  If block_size is 0, liblzma picks a block
+ * size suitable for the preset.  Small blocks allow the table base to
+ * be decompressed lazily (see set_tablebase_cache()) at the expense
+ * of a somewhat worse compression ratio.  tb must have been returned
+ * by generate_tablebase(), as only the generator knows which positions
+ * are live.  This function returns 0 on success, -1 on error with
+ * errno indicating the reason for failure.
+ */
+extern int
+write_tablebase(FILE *f, const struct tablebase *tb, int compression,
+    size_t block_size, int threads)
+{
+	struct tb_writer writer;
+
+	if (tb->live.ranks != NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (init_writer(&writer, f, tb, compression, block_size, threads) != 0)
+		return (-1);
+
+	set_ready(&writer, POSITION_COUNT);
+	writer_thread((void*)&writer);
+	destroy_writer(&writer);
+	if (writer.error != 0) {
+		errno = writer.error;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Write the win/draw/loss bitbase of tb to file f, which is assumed to
+ * have been opened in binary mode for writing and truncated.  The
+ * bitbase is not compressed, so it can be mapped into memory.  This
+ * function returns 0 on success, -1 on error with errno indicating the
+ * reason for failure.
  */
 extern int
-write_tablebase(FILE *f, const struct tablebase *tb)
+write_bitbase(FILE *f, const struct tablebase *tb)
+{
+	size_t i;
+	tb_entry e;
+	unsigned char *bits, wdl;
+	int error = 0;
+
+	bits = calloc(TB_HEADER_SIZE + WDL_SIZE, 1);
+	if (bits == NULL)
+		return (-1);
+
+	for (i = 0; i < POSITION_COUNT; i++) {
+		e = tb->positions[i];
+		wdl = is_win(e) ? WDL_WIN : is_loss(e) ? WDL_LOSS : WDL_DRAW;
+		bits[TB_HEADER_SIZE + i / 4] |= wdl << 2 * (i % 4);
+	}
+
+	make_wdlheader(bits, lzma_crc64(bits + TB_HEADER_SIZE, WDL_SIZE, 0));
+	/* a short write need not set errno */
+	errno = 0;
+	if (fwrite(bits, TB_HEADER_SIZE + WDL_SIZE, 1, f) != 1 || fflush(f) != 0)
+		error = errno != 0 ? errno : EIO;
+
+	free(bits);
+	if (error != 0) {
+		errno = error;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Initialize writer to write tb to f with the given compression
+ * settings.  Return 0 on success, -1 on error with errno set.
+ */
+static int
+init_writer(struct tb_writer *writer, FILE *f, const struct tablebase *tb,
+    int compression, size_t block_size, int threads)
+{
+	int error;
+
+	if (threads <= 0 || (compression != TB_UNCOMPRESSED
+	    && (unsigned)(compression & ~(TB_XZ_EXTREME | TB_XZ_PREDICT)) > 9)) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	writer->f = f;
+	writer->tb = tb;
+	writer->ready = 0;
+	writer->compression = compression;
+	writer->block_size = block_size;
+	writer->threads = threads;
+	writer->error = 0;
+
+	error = pthread_mutex_init(&writer->lock, NULL);
+	if (error != 0) {
+		errno = error;
+		return (-1);
+	}
+
+	error = pthread_cond_init(&writer->progress, NULL);
+	if (error != 0) {
+		pthread_mutex_destroy(&writer->lock);
+		errno = error;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Release the resources held by writer.
+ */
+static void
+destroy_writer(struct tb_writer *writer)
+{
+
+	pthread_cond_destroy(&writer->progress);
+	pthread_mutex_destroy(&writer->lock);
+}
+
+/*
+ * Write the table base described by writer_arg, a struct tb_writer,
+ * as it becomes ready.  Failure is recorded in writer->error.
+ */
+static void *
+writer_thread(void *writer_arg)
+{
+	struct tb_writer *writer = writer_arg;
+
+	if (write_container(writer) != 0)
+		writer->error = errno;
+
+	return (NULL);
+}
+
+/*
+ * Write the header, the entries of the live positions as they become
+ * ready, the live bitmap, and the index of the table base described by
+ * writer, compressing them if requested.  Return 0 on success, -1 on
+ * error with errno set.
+ */
+static int
+write_container(struct tb_writer *writer)
+{
+	size_t i, done = 0, ready, size[OWNERSHIP_COUNT];
+	uint64_t crc[OWNERSHIP_COUNT + 1];
+	const unsigned char *live = writer->tb->live.bits;
+	unsigned char *header, *entries, *bits = NULL, index[TB_INDEX_SIZE];
+	unsigned ref[OWNERSHIP_COUNT];
+	int error;
+
+	header = malloc(TB_HEADER_SIZE);
+	entries = malloc(TB_SECTION_SIZE);
+	if (header == NULL || entries == NULL) {
+		free(header);
+		free(entries);
+		return (-1);
+	}
+
+	if (writer->compression != TB_UNCOMPRESSED && init_xz(writer) != 0) {
+		free(header);
+		free(entries);
+		return (-1);
+	}
+
+	make_tbheader(header);
+	if (emit(writer, header, TB_HEADER_SIZE, LZMA_RUN) != 0)
+		goto fail;
+
+	memset(crc, 0, sizeof crc);
+	memset(size, 0, sizeof size);
+	do {
+		ready = wait_ready(writer, done);
+		if (emit_live(writer, done, ready, entries, crc, size) != 0)
+			goto fail;
+
+		done = ready;
+	} while (done < POSITION_COUNT);
+
+	memset(entries, 0, TB_LIVE_OFFSET - LIVE_COUNT);
+	if (emit(writer, entries, TB_LIVE_OFFSET - LIVE_COUNT, LZMA_RUN) != 0)
+		goto fail;
+
+	for (i = 0; i < OWNERSHIP_COUNT; i++)
+		ref[i] = i;
+
+	/* TB_UNCOMPRESSED has all bits set */
+	if (writer->compression != TB_UNCOMPRESSED && writer->compression & TB_XZ_PREDICT) {
+		bits = malloc(LIVE_SIZE);
+		if (bits == NULL)
+			goto fail;
+
+		choose_refs(writer->tb, ref);
+		memcpy(bits, live, LIVE_SIZE);
+		predict_live(bits, ref);
+		live = bits;
+	}
+
+	crc[OWNERSHIP_COUNT] = lzma_crc64(live, LIVE_SIZE, 0);
+	if (emit(writer, live, LIVE_SIZE, LZMA_RUN) != 0)
+		goto fail;
+
+	make_tbindex(index, crc, size, ref);
+	if (emit(writer, index, sizeof index, LZMA_FINISH) != 0)
+		goto fail;
+
+	free(header);
+	free(entries);
+	free(bits);
+	if (writer->compression != TB_UNCOMPRESSED)
+		lzma_end(&writer->strm);
+
+	return (fflush(writer->f) != 0 ? -1 : 0);
+
+fail:
+	error = errno;
+	free(header);
+	free(entries);
+	free(bits);
+	if (writer->compression != TB_UNCOMPRESSED)
+		lzma_end(&writer->strm);
+
+	errno = error;
+
+	return (-1);
+}
+
+/*
+ * Write the entries of the live positions in slots begin to end - 1
+ * of the table base described by writer and account for them in the
+ * checksums crc and the sizes size of their sections.  buf has room
+ * for the entries of one section.  Return 0 on success, -1 on error
+ * with errno set.
+ */
+static int
+emit_live(struct tb_writer *writer, size_t begin, size_t end, unsigned char *buf,
+    uint64_t *crc, size_t *size)
+{
+	const signed char *positions = (const signed char *)writer->tb->positions;
+	const unsigned char *live = writer->tb->live.bits;
+	size_t i, n, stop;
+
+	while (begin < end) {
+		i = begin / TB_SECTION_SIZE;
+		stop = (i + 1) * TB_SECTION_SIZE;
+		if (stop > end)
+			stop = end;
+
+		for (n = 0; begin < stop; begin++)
+			if (live[begin / 8] & 1 << begin % 8)
+				buf[n++] = positions[begin];
+
+		crc[i] = lzma_crc64(buf, n, crc[i]);
+		size[i] += n;
+		if (emit(writer, buf, n, LZMA_RUN) != 0)
+			return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Choose for each section of tb the earlier section whose live bitmap
+ * predicts its own best and store it in ref (see predict_live()).
+ * Whether a position is live follows from its entry, so the section
+ * whose entries agree with those of the section in the most slots is
+ * taken, comparing the entries of every REF_STRIDE th slot.  The first
+ * section has no earlier section and refers to itself.
+ */
+static void
+choose_refs(const struct tablebase *tb, unsigned *ref)
+{
+	const signed char *positions = (const signed char *)tb->positions;
+	size_t i, j, k, agree, best;
+
+	ref[0] = 0;
+	for (i = 1; i < OWNERSHIP_COUNT; i++) {
+		best = 0;
+		for (j = 0; j < i; j++) {
+			agree = 0;
+			for (k = 0; k < TB_SECTION_SIZE; k += REF_STRIDE)
+				agree += positions[i * TB_SECTION_SIZE + k] == positions[j * TB_SECTION_SIZE + k];
+
+			if (j == 0 || agree > best) {
+				best = agree;
+				ref[i] = j;
+			}
+		}
+	}
+}
+
+/*
+ * Wait until more than done bytes of the table are ready to be
+ * written and return how many are.
+ */
+static size_t
+wait_ready(struct tb_writer *writer, size_t done)
+{
+	size_t ready;
+
+	pthread_mutex_lock(&writer->lock);
+	while (writer->ready <= done)
+		pthread_cond_wait(&writer->progress, &writer->lock);
+
+	ready = writer->ready;
+	pthread_mutex_unlock(&writer->lock);
+
+	return (ready < POSITION_COUNT ? ready : POSITION_COUNT);
+}
+
+/*
+ * Tell writer that the first ready bytes of the table are final.
+ */
+static void
+set_ready(struct tb_writer *writer, size_t ready)
+{
+
+	pthread_mutex_lock(&writer->lock);
+	writer->ready = ready;
+	pthread_cond_signal(&writer->progress);
+	pthread_mutex_unlock(&writer->lock);
+}
+
+/*
+ * Set up writer->strm to compress the table base into an xz file.
+ * liblzma's multi-threaded encoder splits the table into blocks that
+ * are compressed in parallel.  The result is an ordinary xz file that
+ * read_tablebase() understands.  Return 0 on success, -1 on failure
+ * with errno set.
+ */
+static int
+init_xz(struct tb_writer *writer)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_mt mt;
+	lzma_ret ret;
+
+	memset(&mt, 0, sizeof mt);
+	mt.threads = writer->threads;
+	mt.preset = writer->compression & ~(TB_XZ_EXTREME | TB_XZ_PREDICT);
+	if (writer->compression & TB_XZ_EXTREME)
+		mt.preset |= LZMA_PRESET_EXTREME;
+
+	mt.check = LZMA_CHECK_CRC32;
+	mt.block_size = writer->block_size;
+
+	writer->strm = strm;
+	ret = lzma_stream_encoder_mt(&writer->strm, &mt);
+	if (ret != LZMA_OK) {
+		errno = ret == LZMA_MEM_ERROR ? ENOMEM : EINVAL;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Write len bytes from data to writer->f, compressing them first if
+ * the table base is compressed.  action is LZMA_FINISH for the last
+ * piece of data and LZMA_RUN otherwise.  Return 0 on success, -1 on
+ * error with errno set.
+ */
+static int
+emit(struct tb_writer *writer, const void *data, size_t len, lzma_action action)
 {
+	lzma_stream *strm = &writer->strm;
+	lzma_ret ret;
+	size_t count;
+	uint8_t outbuf[BUFSIZ];
+
+	if (writer->compression == TB_UNCOMPRESSED) {
+		if (fwrite(data, 1, len, writer->f) != len) {
+			errno = EIO;
+			return (-1);
+		}
 
-	fwrite((void*)tb->positions, sizeof tb->positions, 1, f);
-	fflush(f);
+		return (0);
+	}
+
+	strm->next_in = data;
+	strm->avail_in = len;
+
+	do {
+		strm->next_out = outbuf;
+		strm->avail_out = sizeof outbuf;
+		ret = lzma_code(strm, action);
+		if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+			errno = ret == LZMA_MEM_ERROR ? ENOMEM : EINVAL;
+			return (-1);
+		}
+
+		count = sizeof outbuf - strm->avail_out;
+		if (fwrite(outbuf, 1, count, writer->f) != count) {
+			errno = EIO;
+			return (-1);
+		}
+	} while (action == LZMA_FINISH ? ret != LZMA_STREAM_END : strm->avail_in > 0);
 
-	return (ferror(f) ? -1 : 0);
+	return (0);
 }
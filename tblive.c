@@ -0,0 +1,174 @@
+/*-
+ * Copyright (c) 2026 Robert Clausecker. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dobutsutable.h"
+
+static unsigned	count_bits(const unsigned char *, size_t);
+static void	xor_bits(unsigned char *, size_t, const unsigned char *, size_t, size_t);
+
+/*
+ * Set up live for the live bitmap bits: compute the number of live
+ * positions before each block of the bitmap and before each word
+ * within the block (see struct tblive).  bits must remain valid
+ * while live is used.  Return 0 on success or -1 on error with errno
+ * set.  If the bitmap does not mark LIVE_COUNT positions as live, it
+ * cannot belong to a table of the current layout and errno is set to
+ * EINVAL.
+ */
+extern int
+index_live(struct tblive *live, const unsigned char *bits)
+{
+	size_t i, j, rank = 0, nblock = LIVE_SIZE / (LIVE_BLOCK / 8);
+	uint64_t entry;
+	unsigned count;
+
+	live->ranks = malloc(nblock * sizeof *live->ranks);
+	if (live->ranks == NULL)
+		return (-1);
+
+	for (i = 0; i < nblock; i++) {
+		entry = rank;
+		for (j = count = 0; j < LIVE_BLOCK / 64; j++) {
+			entry |= (uint64_t)count << (32 + 8 * j);
+			count += count_bits(bits + i * (LIVE_BLOCK / 8) + j * 8, 8);
+		}
+
+		live->ranks[i] = entry;
+		rank += count;
+	}
+
+	if (rank != LIVE_COUNT) {
+		free(live->ranks);
+		live->ranks = NULL;
+		errno = EINVAL;
+		return (-1);
+	}
+
+	live->bits = bits;
+
+	return (0);
+}
+
+/*
+ * Return the number of bits set in the len bytes at bits, where len
+ * is a multiple of 8.  The order of the bytes in each word does not
+ * matter for this.
+ */
+static unsigned
+count_bits(const unsigned char *bits, size_t len)
+{
+	uint64_t word;
+	size_t i;
+	unsigned count = 0;
+
+	for (i = 0; i < len; i += 8) {
+		memcpy(&word, bits + i, sizeof word);
+		word -= word >> 1 & 0x5555555555555555ULL;
+		word = (word & 0x3333333333333333ULL) + (word >> 2 & 0x3333333333333333ULL);
+		word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+		count += word * 0x0101010101010101ULL >> 56;
+	}
+
+	return (count);
+}
+
+/*
+ * Transform the live bitmap bits in place for storage: the bits of
+ * each section i are exclusive-or'ed with those of section ref[i],
+ * which must be at most i.  If ref[i] is i, the section is left as
+ * is.  As the reference sections come first, restore_live() undoes
+ * this by going through the sections in the opposite order.
+ */
+extern void
+predict_live(unsigned char *bits, const unsigned *ref)
+{
+	size_t i;
+
+	for (i = OWNERSHIP_COUNT; i-- > 0; )
+		if (ref[i] != i)
+			xor_bits(bits, i * TB_SECTION_SIZE, bits, ref[i] * TB_SECTION_SIZE, TB_SECTION_SIZE);
+}
+
+/*
+ * Undo predict_live() on bits with the same reference sections ref.
+ */
+extern void
+restore_live(unsigned char *bits, const unsigned *ref)
+{
+	size_t i;
+
+	for (i = 0; i < OWNERSHIP_COUNT; i++)
+		if (ref[i] != i)
+			xor_bits(bits, i * TB_SECTION_SIZE, bits, ref[i] * TB_SECTION_SIZE, TB_SECTION_SIZE);
+}
+
+/*
+ * Exclusive-or the n bits of src starting at bit srcpos into dst
+ * starting at bit dstpos.  The sections are not aligned to bytes, so
+ * the bits are moved one byte of dst at a time.  The ranges must not
+ * overlap.
+ */
+static void
+xor_bits(unsigned char *dst, size_t dstpos, const unsigned char *src, size_t srcpos,
+    size_t n)
+{
+	unsigned x, len, shift;
+
+	while (n > 0) {
+		len = 8 - dstpos % 8;
+		if (len > n)
+			len = n;
+
+		/* only read the second byte if it is needed */
+		shift = srcpos % 8;
+		x = src[srcpos / 8] >> shift;
+		if (shift + len > 8)
+			x |= src[srcpos / 8 + 1] << (8 - shift);
+
+		dst[dstpos / 8] ^= (x & ((1U << len) - 1)) << dstpos % 8;
+		dstpos += len;
+		srcpos += len;
+		n -= len;
+	}
+}
+
+/*
+ * Release the ranks of live and its copy of the bitmap, if any.
+ */
+extern void
+free_live(struct tblive *live)
+{
+
+	free(live->ranks);
+	free(live->copy);
+	live->bits = NULL;
+	live->ranks = NULL;
+	live->copy = NULL;
+}
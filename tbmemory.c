@@ -0,0 +1,379 @@
+/*-
+ * Copyright (c) 2026 Robert Clausecker. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifdef __linux__
+# define _GNU_SOURCE /* for MAP_ANONYMOUS, MAP_HUGETLB, and MADV_HUGEPAGE */
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dobutsutable.h"
+
+/* MAP_HUGE_2MB and MAP_HUGE_1GB are missing from older headers */
+#if defined(MAP_HUGETLB) && !defined(MAP_HUGE_SHIFT)
+# define MAP_HUGE_SHIFT 26
+#endif
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+static int	tbmem_flags = TBMEM_DEFAULT;
+
+static int	map_table(struct tablebase *, size_t, int);
+static void	prefault(const struct tablebase *);
+
+/*
+ * Parse a comma separated list of tablebase memory options as accepted
+ * by the -m option of the programs in this package and return the
+ * corresponding TBMEM_* flags.  Valid options are 2m and 1g (back the
+ * table with huge pages of that size), thp (ask for transparent huge
+ * pages), prefault (fault in all pages when allocating the table), lock
+ * (lock the table into memory), shared (share decompressed tables
+ * with other processes), and packed (pack the table after loading it).
+ * Return -1 if spec is invalid.
+ */
+extern int
+parse_tablebase_memory(const char *spec)
+{
+	size_t len;
+	int flags = TBMEM_DEFAULT;
+
+	while (*spec != '\0') {
+		len = strcspn(spec, ",");
+		if (len == 2 && strncmp(spec, "2m", len) == 0)
+			flags |= TBMEM_HUGE_2M;
+		else if (len == 2 && strncmp(spec, "1g", len) == 0)
+			flags |= TBMEM_HUGE_1G;
+		else if (len == 3 && strncmp(spec, "thp", len) == 0)
+			flags |= TBMEM_THP;
+		else if (len == 8 && strncmp(spec, "prefault", len) == 0)
+			flags |= TBMEM_PREFAULT;
+		else if (len == 4 && strncmp(spec, "lock", len) == 0)
+			flags |= TBMEM_LOCK;
+		else if (len == 6 && strncmp(spec, "shared", len) == 0)
+			flags |= TBMEM_SHARED;
+		else if (len == 6 && strncmp(spec, "packed", len) == 0)
+			flags |= TBMEM_PACKED;
+		else
+			return (-1);
+
+		spec += len;
+		if (*spec == ',')
+			spec++;
+	}
+
+	return (flags);
+}
+
+/*
+ * Set the TBMEM_* flags used when allocating tablebases from now on.
+ */
+extern void
+set_tablebase_memory(int flags)
+{
+
+	tbmem_flags = flags;
+}
+
+/*
+ * Return the TBMEM_* flags set with set_tablebase_memory().
+ */
+extern int
+get_tablebase_memory(void)
+{
+
+	return (tbmem_flags);
+}
+
+/*
+ * Parse a size in bytes, optionally followed by one of the suffixes k,
+ * m, or g (case insensitive) to multiply it by 1024, 1024², or 1024³
+ * and store it in *size.  Return 0 on success, -1 if spec is invalid.
+ */
+extern int
+parse_size(const char *spec, size_t *size)
+{
+	unsigned long long value, shift = 0;
+	char *endptr;
+
+	if (*spec < '0' || *spec > '9')
+		return (-1);
+
+	value = strtoull(spec, &endptr, 10);
+	switch (*endptr) {
+	case 'g':
+	case 'G':
+		shift += 10;
+		/* FALLTHROUGH */
+	case 'm':
+	case 'M':
+		shift += 10;
+		/* FALLTHROUGH */
+	case 'k':
+	case 'K':
+		shift += 10;
+		endptr++;
+		/* FALLTHROUGH */
+	case '\0':
+		break;
+
+	default:
+		return (-1);
+	}
+
+	if (*endptr != '\0' || value > (size_t)-1 >> shift)
+		return (-1);
+
+	*size = value << shift;
+
+	return (0);
+}
+
+/*
+ * Allocate a tablebase with room for size positions, all initialized to
+ * zero, according to the flags set with set_tablebase_memory().  If
+ * huge pages are requested but not available, fall back to smaller
+ * huge pages, transparent huge pages, and finally normal pages.  If
+ * the table cannot be locked into memory, it is left unlocked.  Return
+ * a pointer to the new tablebase or NULL with errno set on failure.
+ */
+extern struct tablebase *
+alloc_tablebase(size_t size)
+{
+	struct tablebase *tb;
+	int flags = tbmem_flags;
+
+	tb = malloc(sizeof *tb);
+	if (tb == NULL)
+		return (NULL);
+
+	tb->size = size;
+	tb->mapping = 0;
+	tb->cache = NULL;
+	tb->pack = NULL;
+	tb->live.bits = NULL;
+	tb->live.ranks = NULL;
+	tb->live.copy = NULL;
+	tb->wdl = 0;
+	if ((flags & TBMEM_HUGE_1G) && map_table(tb, size, TBMEM_HUGE_1G) == 0)
+		goto allocated;
+
+	if ((flags & (TBMEM_HUGE_1G | TBMEM_HUGE_2M))
+	    && map_table(tb, size, TBMEM_HUGE_2M) == 0)
+		goto allocated;
+
+	if ((flags & (TBMEM_HUGE_1G | TBMEM_HUGE_2M | TBMEM_THP))
+	    && map_table(tb, size, TBMEM_THP) == 0)
+		goto allocated;
+
+	/* calloc() does not touch large allocations */
+	tb->positions = calloc(size, 1);
+	if (tb->positions == NULL) {
+		free(tb);
+		return (NULL);
+	}
+
+allocated:
+	if (flags & TBMEM_PREFAULT)
+		memset((void*)tb->positions, 0, size);
+
+	/* mlock() faults in all pages, too */
+	if (flags & TBMEM_LOCK)
+		mlock((void*)tb->positions, size);
+
+	return (tb);
+}
+
+/*
+ * Map size positions from file descriptor fd starting at offset
+ * read-only into memory and return a tablebase for them.  The table
+ * then shares the page cache with all other processes mapping the same
+ * file and pages are only read in when they are probed.  As probes go
+ * all over the table, the kernel is told not to read ahead unless
+ * TBMEM_PREFAULT is set in which case the whole table is read in
+ * right away.  Huge pages cannot be used for such a mapping, so
+ * if they have been requested, NULL is returned with errno set to
+ * EOPNOTSUPP and the table should be read into an allocated table
+ * base instead.  NULL is also returned on error with errno set.
+ */
+extern struct tablebase *
+map_tablebase(int fd, off_t offset, size_t size)
+{
+	struct tablebase *tb;
+	struct stat st;
+	void *table;
+	long pagesize;
+	int flags = tbmem_flags, error;
+
+	if (flags & (TBMEM_HUGE_1G | TBMEM_HUGE_2M | TBMEM_THP)) {
+		errno = EOPNOTSUPP;
+		return (NULL);
+	}
+
+	/* mmap() requires offset to be a multiple of the page size */
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (pagesize <= 0 || offset % pagesize != 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	if (fstat(fd, &st) != 0)
+		return (NULL);
+
+	if (!S_ISREG(st.st_mode) || st.st_size < offset || (size_t)(st.st_size - offset) < size) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	tb = malloc(sizeof *tb);
+	if (tb == NULL)
+		return (NULL);
+
+	table = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, offset);
+	if (table == MAP_FAILED) {
+		error = errno;
+		free(tb);
+		errno = error;
+		return (NULL);
+	}
+
+	posix_madvise(table, size, flags & TBMEM_PREFAULT ? POSIX_MADV_WILLNEED : POSIX_MADV_RANDOM);
+	tb->positions = table;
+	tb->size = size;
+	tb->mapping = size;
+	tb->cache = NULL;
+	tb->pack = NULL;
+	tb->live.bits = NULL;
+	tb->live.ranks = NULL;
+	tb->live.copy = NULL;
+	tb->wdl = 0;
+
+	if (flags & TBMEM_PREFAULT)
+		prefault(tb);
+
+	if (flags & TBMEM_LOCK)
+		mlock(table, size);
+
+	return (tb);
+}
+
+/*
+ * Fault in all pages of the read-only table tb by reading one byte
+ * of each page.
+ */
+static void
+prefault(const struct tablebase *tb)
+{
+	size_t i, pagesize = sysconf(_SC_PAGESIZE);
+	volatile unsigned char sum = 0;
+
+	for (i = 0; i < tb->size; i += pagesize)
+		sum += ((const unsigned char *)tb->positions)[i];
+
+	(void)sum;
+}
+
+/*
+ * Release all storage associated with tb.  The pointer to tb then
+ * becomes invalid.
+ */
+extern void
+free_tablebase(struct tablebase *tb)
+{
+
+	if (tb == NULL)
+		return;
+
+	if (tb->pack != NULL)
+		free_tablebase_pack(tb->pack);
+	else if (tb->cache != NULL)
+		free_tablebase_cache(tb->cache);
+	else if (tb->mapping != 0)
+		munmap((void*)tb->positions, tb->mapping);
+	else
+		free((void*)tb->positions);
+
+	free_live(&tb->live);
+
+	free(tb);
+}
+
+/*
+ * Map an anonymous region for the positions of tb large enough to
+ * hold size positions using the kind of page indicated by kind, one of
+ * TBMEM_HUGE_1G, TBMEM_HUGE_2M, and TBMEM_THP.  Return 0 on success or
+ * -1 if this kind of page is not available.
+ */
+static int
+map_table(struct tablebase *tb, size_t size, int kind)
+{
+	void *table;
+	size_t pagesize;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+	switch (kind) {
+#ifdef MAP_HUGETLB
+	case TBMEM_HUGE_1G:
+		pagesize = (size_t)1 << 30;
+		flags |= MAP_HUGETLB | 30 << MAP_HUGE_SHIFT;
+		break;
+
+	case TBMEM_HUGE_2M:
+		pagesize = (size_t)1 << 21;
+		flags |= MAP_HUGETLB | 21 << MAP_HUGE_SHIFT;
+		break;
+#endif
+
+#ifdef MADV_HUGEPAGE
+	case TBMEM_THP:
+		pagesize = (size_t)1 << 21;
+		break;
+#endif
+
+	default:
+		return (-1);
+	}
+
+	size = (size + pagesize - 1) & ~(pagesize - 1);
+	table = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (table == MAP_FAILED)
+		return (-1);
+
+#ifdef MADV_HUGEPAGE
+	if (kind == TBMEM_THP && madvise(table, size, MADV_HUGEPAGE) != 0) {
+		munmap(table, size);
+		return (-1);
+	}
+#endif
+
+	tb->positions = table;
+	tb->mapping = size;
+
+	return (0);
+}
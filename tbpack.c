@@ -0,0 +1,163 @@
+/*-
+ * Copyright (c) 2026 Robert Clausecker. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "dobutsutable.h"
+
+static void	choose_codes(struct tbpack *, const signed char *, size_t, unsigned char *);
+
+/*
+ * Replace the entries of tb with a packed table (see struct tbpack)
+ * and release them, keeping a copy of the live bitmap.  Most entries
+ * of the tablebase share a handful of values, so the packed table
+ * takes about 80% of the memory.  Lookups stay exact, but the escaped
+ * entries need up to three memory accesses.  tb must have been read
+ * from a file and must not be decompressed lazily.
+ * If TBMEM_LOCK is set, the packed table is locked into memory.
+ * Return 0 on success or -1 on error with errno set, in which case tb
+ * is unchanged.
+ */
+extern int
+pack_tablebase(struct tablebase *tb)
+{
+	struct tbpack *pack;
+	const signed char *positions = (const signed char *)tb->positions;
+	size_t i, nblock, rank = 0;
+	unsigned char *bits, code, map[UCHAR_MAX + 1];
+	int error;
+
+	pack = malloc(sizeof *pack);
+	if (pack == NULL)
+		return (-1);
+
+	choose_codes(pack, positions, LIVE_COUNT, map);
+
+	/*
+	 * Room for whole blocks so packed_entry() never reads past the end.
+	 * The padding is filled with code 0, so it is never escaped.
+	 */
+	nblock = (LIVE_COUNT + TBPACK_BLOCK - 1) / TBPACK_BLOCK;
+	pack->codes = calloc(nblock, TBPACK_BLOCK / 2);
+	pack->ranks = malloc(nblock * sizeof *pack->ranks);
+	pack->escapes = malloc(pack->nescape > 0 ? pack->nescape : 1);
+	bits = malloc(LIVE_SIZE);
+	if (pack->codes == NULL || pack->ranks == NULL || pack->escapes == NULL
+	    || bits == NULL) {
+		error = errno;
+		free_tablebase_pack(pack);
+		free(bits);
+		errno = error;
+		return (-1);
+	}
+
+	for (i = 0; i < LIVE_COUNT; i++) {
+		if (i % TBPACK_BLOCK == 0)
+			pack->ranks[i / TBPACK_BLOCK] = rank;
+
+		code = map[(unsigned char)positions[i]];
+		if (code == TBPACK_ESCAPE)
+			pack->escapes[rank++] = positions[i];
+
+		pack->codes[i / 2] |= code << 4 * (i % 2);
+	}
+
+	if (get_tablebase_memory() & TBMEM_LOCK) {
+		mlock(pack->codes, nblock * (TBPACK_BLOCK / 2));
+		mlock(pack->ranks, nblock * sizeof *pack->ranks);
+		mlock(pack->escapes, pack->nescape);
+		mlock(bits, LIVE_SIZE);
+	}
+
+	/* the ranks of the live bitmap stay valid for the copy */
+	memcpy(bits, tb->live.bits, LIVE_SIZE);
+	tb->live.bits = bits;
+	tb->live.copy = bits;
+
+	if (tb->mapping != 0)
+		munmap((void*)tb->positions, tb->mapping);
+	else
+		free((void*)tb->positions);
+
+	tb->positions = NULL;
+	tb->mapping = 0;
+	tb->pack = pack;
+
+	return (0);
+}
+
+/*
+ * Assign the TBPACK_CODES most common of the size positions to codes,
+ * store the value of each code in pack->values, and the number of
+ * positions that are not assigned a code in pack->nescape.  For each
+ * value, map receives its code or TBPACK_ESCAPE.
+ */
+static void
+choose_codes(struct tbpack *pack, const signed char *positions, size_t size,
+    unsigned char *map)
+{
+	size_t i, histogram[UCHAR_MAX + 1] = { 0 };
+	unsigned code, value, best;
+
+	for (i = 0; i < size; i++)
+		histogram[(unsigned char)positions[i]]++;
+
+	memset(map, TBPACK_ESCAPE, UCHAR_MAX + 1);
+	memset(pack->values, 0, sizeof pack->values);
+	pack->nescape = size;
+	for (code = 0; code < TBPACK_CODES; code++) {
+		/* values that do not occur need no code */
+		best = UCHAR_MAX + 1;
+		for (value = 0; value <= UCHAR_MAX; value++)
+			if (map[value] == TBPACK_ESCAPE && histogram[value] > 0
+			    && (best > UCHAR_MAX || histogram[value] > histogram[best]))
+				best = value;
+
+		if (best > UCHAR_MAX)
+			break;
+
+		map[best] = code;
+		pack->values[code] = (signed char)best;
+		pack->nescape -= histogram[best];
+	}
+}
+
+/*
+ * Release all storage associated with pack.
+ */
+extern void
+free_tablebase_pack(struct tbpack *pack)
+{
+
+	free(pack->codes);
+	free(pack->ranks);
+	free(pack->escapes);
+	free(pack);
+}
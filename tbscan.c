@@ -0,0 +1,334 @@
+/*-
+ * Copyright (c) 2026 Robert Clausecker. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <limits.h>
+#include <stddef.h>
+
+#include "dobutsutable.h"
+
+/*
+ * Kernels for passes over large parts of the tablebase.  On x86, the
+ * kernels come in SSE2, AVX2, and AVX-512 variants, the best of which
+ * is selected at runtime.  Each variant processes as many full vectors
+ * as possible and leaves the rest to the scalar code.
+ */
+#if defined(__GNUC__) && __GNUC__ >= 6 && (defined(__x86_64__) || defined(__i386__))
+# define SCAN_X86
+# include <immintrin.h>
+
+# define SSE2 __attribute__((target("sse2")))
+# define AVX2 __attribute__((target("avx2,popcnt")))
+# define AVX512 __attribute__((target("avx512f,avx512bw,popcnt")))
+#endif
+
+static void	scan_wdl_scalar(signed char *, size_t, size_t, unsigned *, unsigned *, unsigned *);
+static void	scan_equal_scalar(const signed char *, size_t, size_t, signed char, atomic_uchar *);
+static size_t	scan_nonzero_scalar(const unsigned char *, size_t, size_t);
+
+#ifdef SCAN_X86
+static SSE2 void	scan_wdl_sse2(signed char *, size_t, unsigned *, unsigned *, unsigned *);
+static AVX2 void	scan_wdl_avx2(signed char *, size_t, unsigned *, unsigned *, unsigned *);
+static AVX512 void	scan_wdl_avx512(signed char *, size_t, unsigned *, unsigned *, unsigned *);
+static SSE2 void	scan_equal_sse2(const signed char *, size_t, signed char, atomic_uchar *);
+static AVX2 void	scan_equal_avx2(const signed char *, size_t, signed char, atomic_uchar *);
+static AVX512 void	scan_equal_avx512(const signed char *, size_t, signed char, atomic_uchar *);
+static SSE2 size_t	scan_nonzero_sse2(const unsigned char *, size_t, size_t);
+static AVX2 size_t	scan_nonzero_avx2(const unsigned char *, size_t, size_t);
+static AVX512 size_t	scan_nonzero_avx512(const unsigned char *, size_t, size_t);
+#endif
+
+/*
+ * Count the wins, losses, and draws among the n entries starting at
+ * positions and add them to *win, *loss, and *draw.  Also replace all
+ * immediate wins (1) with 2 as we never look them up.
+ */
+extern void
+scan_wdl(atomic_schar *positions, size_t n, unsigned *win, unsigned *loss, unsigned *draw)
+{
+	signed char *p = (signed char *)positions;
+
+#ifdef SCAN_X86
+	if (__builtin_cpu_supports("avx512bw"))
+		scan_wdl_avx512(p, n, win, loss, draw);
+	else if (__builtin_cpu_supports("avx2"))
+		scan_wdl_avx2(p, n, win, loss, draw);
+	else if (__builtin_cpu_supports("sse2"))
+		scan_wdl_sse2(p, n, win, loss, draw);
+	else
+#endif
+		scan_wdl_scalar(p, 0, n, win, loss, draw);
+}
+
+/*
+ * For each of the n entries starting at positions that is equal to
+ * value, set the corresponding bit in bitmap.  Other bits are left
+ * unchanged.  This function is not thread safe.
+ */
+extern void
+scan_equal(const atomic_schar *positions, size_t n, tb_entry value, atomic_uchar *bitmap)
+{
+	const signed char *p = (const signed char *)positions;
+
+#ifdef SCAN_X86
+	if (__builtin_cpu_supports("avx512bw"))
+		scan_equal_avx512(p, n, value, bitmap);
+	else if (__builtin_cpu_supports("avx2"))
+		scan_equal_avx2(p, n, value, bitmap);
+	else if (__builtin_cpu_supports("sse2"))
+		scan_equal_sse2(p, n, value, bitmap);
+	else
+#endif
+		scan_equal_scalar(p, 0, n, value, bitmap);
+}
+
+/*
+ * Return the index of the first nonzero byte in bytes from begin to
+ * end - 1 or end if there is none.
+ */
+extern size_t
+scan_nonzero(const atomic_uchar *bytes, size_t begin, size_t end)
+{
+	const unsigned char *p = (const unsigned char *)bytes;
+
+#ifdef SCAN_X86
+	if (__builtin_cpu_supports("avx512bw"))
+		return (scan_nonzero_avx512(p, begin, end));
+	else if (__builtin_cpu_supports("avx2"))
+		return (scan_nonzero_avx2(p, begin, end));
+	else if (__builtin_cpu_supports("sse2"))
+		return (scan_nonzero_sse2(p, begin, end));
+	else
+#endif
+		return (scan_nonzero_scalar(p, begin, end));
+}
+
+/*
+ * The scalar kernels process entries i to n - 1.
+ */
+static void
+scan_wdl_scalar(signed char *p, size_t i, size_t n, unsigned *win, unsigned *loss, unsigned *draw)
+{
+
+	for (; i < n; i++) {
+		if (is_win(p[i]))
+			++*win;
+		else if (is_loss(p[i]))
+			++*loss;
+		else /* is_draw(p[i]) */
+			++*draw;
+
+		if (p[i] == 1)
+			p[i] = 2;
+	}
+}
+
+static void
+scan_equal_scalar(const signed char *p, size_t i, size_t n, signed char value, atomic_uchar *bitmap)
+{
+
+	for (; i < n; i++)
+		if (p[i] == value)
+			bitmap[i / CHAR_BIT] |= 1 << i % CHAR_BIT;
+}
+
+static size_t
+scan_nonzero_scalar(const unsigned char *p, size_t i, size_t n)
+{
+
+	while (i < n && p[i] == 0)
+		i++;
+
+	return (i);
+}
+
+#ifdef SCAN_X86
+/*
+ * For the vector kernels, vectors of entries greater than zero are
+ * wins, less than zero are losses, and the rest are draws.  Immediate
+ * wins are turned into 2 by subtracting the all-ones comparison mask.
+ * The bitmap produced by scan_equal() has the same bit order as the
+ * mask of a vector comparison.
+ */
+static SSE2 void
+scan_wdl_sse2(signed char *p, size_t n, unsigned *win, unsigned *loss, unsigned *draw)
+{
+	__m128i v, ones, zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+	size_t i;
+	unsigned w = 0, l = 0;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		w += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi8(v, zero)));
+		l += __builtin_popcount(_mm_movemask_epi8(_mm_cmplt_epi8(v, zero)));
+		ones = _mm_cmpeq_epi8(v, one);
+		if (_mm_movemask_epi8(ones) != 0)
+			_mm_storeu_si128((__m128i *)(p + i), _mm_sub_epi8(v, ones));
+	}
+
+	*win += w;
+	*loss += l;
+	*draw += i - w - l;
+	scan_wdl_scalar(p, i, n, win, loss, draw);
+}
+
+static AVX2 void
+scan_wdl_avx2(signed char *p, size_t n, unsigned *win, unsigned *loss, unsigned *draw)
+{
+	__m256i v, ones, zero = _mm256_setzero_si256(), one = _mm256_set1_epi8(1);
+	size_t i;
+	unsigned w = 0, l = 0;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		w += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpgt_epi8(v, zero)));
+		l += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpgt_epi8(zero, v)));
+		ones = _mm256_cmpeq_epi8(v, one);
+		if (!_mm256_testz_si256(ones, ones))
+			_mm256_storeu_si256((__m256i *)(p + i), _mm256_sub_epi8(v, ones));
+	}
+
+	*win += w;
+	*loss += l;
+	*draw += i - w - l;
+	scan_wdl_scalar(p, i, n, win, loss, draw);
+}
+
+static AVX512 void
+scan_wdl_avx512(signed char *p, size_t n, unsigned *win, unsigned *loss, unsigned *draw)
+{
+	__m512i v, zero = _mm512_setzero_si512(), one = _mm512_set1_epi8(1);
+	__mmask64 ones;
+	size_t i;
+	unsigned w = 0, l = 0;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		v = _mm512_loadu_si512(p + i);
+		w += __builtin_popcountll(_mm512_cmpgt_epi8_mask(v, zero));
+		l += __builtin_popcountll(_mm512_cmplt_epi8_mask(v, zero));
+		ones = _mm512_cmpeq_epi8_mask(v, one);
+		if (ones != 0)
+			_mm512_mask_storeu_epi8(p + i, ones, _mm512_add_epi8(v, one));
+	}
+
+	*win += w;
+	*loss += l;
+	*draw += i - w - l;
+	scan_wdl_scalar(p, i, n, win, loss, draw);
+}
+
+static SSE2 void
+scan_equal_sse2(const signed char *p, size_t n, signed char value, atomic_uchar *bitmap)
+{
+	__m128i v = _mm_set1_epi8(value);
+	size_t i;
+	unsigned mask;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), v));
+		if (mask == 0)
+			continue;
+
+		bitmap[i / CHAR_BIT + 0] |= mask & 0xff;
+		bitmap[i / CHAR_BIT + 1] |= mask >> 8;
+	}
+
+	scan_equal_scalar(p, i, n, value, bitmap);
+}
+
+static AVX2 void
+scan_equal_avx2(const signed char *p, size_t n, signed char value, atomic_uchar *bitmap)
+{
+	__m256i v = _mm256_set1_epi8(value);
+	size_t i, j;
+	unsigned mask;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), v));
+		for (j = 0; mask != 0; j++, mask >>= CHAR_BIT)
+			bitmap[i / CHAR_BIT + j] |= mask & 0xff;
+	}
+
+	scan_equal_scalar(p, i, n, value, bitmap);
+}
+
+static AVX512 void
+scan_equal_avx512(const signed char *p, size_t n, signed char value, atomic_uchar *bitmap)
+{
+	__m512i v = _mm512_set1_epi8(value);
+	size_t i, j;
+	unsigned long long mask;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		mask = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(p + i), v);
+		for (j = 0; mask != 0; j++, mask >>= CHAR_BIT)
+			bitmap[i / CHAR_BIT + j] |= mask & 0xff;
+	}
+
+	scan_equal_scalar(p, i, n, value, bitmap);
+}
+
+static SSE2 size_t
+scan_nonzero_sse2(const unsigned char *p, size_t i, size_t n)
+{
+	__m128i zero = _mm_setzero_si128();
+	unsigned mask;
+
+	for (; i + 16 <= n; i += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), zero));
+		if (mask != 0xffff)
+			return (i + __builtin_ctz(~mask));
+	}
+
+	return (scan_nonzero_scalar(p, i, n));
+}
+
+static AVX2 size_t
+scan_nonzero_avx2(const unsigned char *p, size_t i, size_t n)
+{
+	__m256i zero = _mm256_setzero_si256();
+	unsigned mask;
+
+	for (; i + 32 <= n; i += 32) {
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), zero));
+		if (mask != 0xffffffffU)
+			return (i + __builtin_ctz(~mask));
+	}
+
+	return (scan_nonzero_scalar(p, i, n));
+}
+
+static AVX512 size_t
+scan_nonzero_avx512(const unsigned char *p, size_t i, size_t n)
+{
+	__mmask64 mask;
+
+	for (; i + 64 <= n; i += 64) {
+		mask = _mm512_test_epi8_mask(_mm512_loadu_si512(p + i), _mm512_loadu_si512(p + i));
+		if (mask != 0)
+			return (i + __builtin_ctzll(mask));
+	}
+
+	return (scan_nonzero_scalar(p, i, n));
+}
+#endif /* SCAN_X86 */
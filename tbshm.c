@@ -0,0 +1,575 @@
+/*-
+ * Copyright (c) 2026 Robert Clausecker. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <lzma.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dobutsutable.h"
+
+/*
+ * A compressed tablebase can be decompressed once into a POSIX shared
+ * memory object or a cache file that all processes loading the same
+ * file then map read-only.  The object begins with a struct
+ * tbshm_header, the tablebase follows at offset TBSHM_OFFSET.  magic
+ * and version identify the layout, size is the number of positions,
+ * and checksum the CRC64 of the positions.  source_size,
+ * source_mtime, and source_checksum are the size, modification time,
+ * and CRC64 of the compressed file, so a changed file is noticed even
+ * if the object is found under the same name.  ready is set once the
+ * tablebase is complete.
+ *
+ * Record locks on the object keep concurrent loaders from stepping on
+ * each other: the process decompressing the tablebase holds a write
+ * lock while doing so, other processes wait for a read lock before
+ * looking at the header.  If the decompressing process dies, its lock
+ * is released and the next process finding ready clear takes over.
+ * A complete object is never modified, so processes having it mapped
+ * are safe: if it turns out to be stale or corrupt, it is unlinked and
+ * a new one is built under the same name.  Objects are only trusted if
+ * they belong to the user or to root.
+ */
+struct tbshm_header {
+	char magic[8];
+	uint32_t version, ready;
+	uint64_t size, checksum;
+	uint64_t source_size, source_mtime, source_checksum;
+};
+
+enum {
+	TBSHM_VERSION = 3,
+	TBSHM_OFFSET = 1 << 16,	/* a multiple of every page size */
+};
+
+static const char tbshm_magic[8] = "DBTBSHM";
+
+static int	source_key(struct tbshm_header *, int);
+static struct tablebase *load_shared(const char *, int, FILE *, const struct tbshm_header *,
+		    int (*)(FILE *, struct tablebase *), int *);
+static int	make_directory(const char *);
+static void	prune_cache(const char *, const char *);
+static int	open_object(const char *, int, int);
+static int	replace_object(const char *, int, int);
+static int	lock_shm(int, short, int);
+static int	check_header(const struct tbshm_header *, const struct tbshm_header *);
+static struct tablebase *attach_shm(int);
+static int	build_shm(int, FILE *, const struct tbshm_header *,
+		    int (*)(FILE *, struct tablebase *));
+
+/*
+ * Load the tablebase in f into a shared memory object using decode to
+ * decompress it from f, or attach to an existing object if another
+ * process already did so.  The object is named after the user, the
+ * version of the object layout, the layout of the tablebase, and the
+ * device, inode, size, and modification time of f, so processes that
+ * do not agree on the layout never share an object.  decode is called
+ * with f and a tablebase to fill and must return 0 on success and -1
+ * on failure.  Return the tablebase on success or NULL on failure with
+ * errno set, in which case the tablebase should be loaded privately.
+ */
+extern struct tablebase *
+share_tablebase(FILE *f, int (*decode)(FILE *, struct tablebase *))
+{
+	struct tbshm_header key;
+	struct stat st;
+	char name[128];
+
+	if (fstat(fileno(f), &st) != 0 || source_key(&key, fileno(f)) != 0)
+		return (NULL);
+
+	snprintf(name, sizeof name, "/dobutsu-%lu-%u-%016llx-%llx-%llx-%llx-%llx",
+	    (unsigned long)getuid(), (unsigned)TBSHM_VERSION,
+	    (unsigned long long)layout_fingerprint(),
+	    (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+	    (unsigned long long)st.st_size, (unsigned long long)st.st_mtime);
+
+	return (load_shared(name, 1, f, &key, decode, NULL));
+}
+
+/*
+ * Like share_tablebase(), but keep the decompressed tablebase in a
+ * cache file in directory dir instead of shared memory, so it survives
+ * a reboot.  dir and its parents are created if needed.  The file is
+ * named after the version of the object
+ * layout, the layout of the tablebase, and the size and checksum of f.
+ * The modification time of f is ignored, so reinstalling the same
+ * file keeps using the cache.  Once a new cache file has been built,
+ * the cache files for other tablebases or versions of dobutsu are
+ * removed, so they do not pile up.
+ */
+extern struct tablebase *
+cache_tablebase(FILE *f, const char *dir, int (*decode)(FILE *, struct tablebase *))
+{
+	struct tablebase *tb;
+	struct tbshm_header key;
+	size_t len;
+	char *name;
+	int error, built = 0;
+
+	if (source_key(&key, fileno(f)) != 0)
+		return (NULL);
+
+	key.source_mtime = 0;
+
+	if (make_directory(dir) != 0)
+		return (NULL);
+
+	len = strlen(dir) + 128;
+	name = malloc(len);
+	if (name == NULL)
+		return (NULL);
+
+	snprintf(name, len, "%s/dobutsu-%u-%016llx-%llx-%016llx.tb", dir,
+	    (unsigned)TBSHM_VERSION, (unsigned long long)layout_fingerprint(),
+	    (unsigned long long)key.source_size, (unsigned long long)key.source_checksum);
+
+	tb = load_shared(name, 0, f, &key, decode, &built);
+	error = errno;
+	if (tb != NULL && built)
+		prune_cache(dir, name + strlen(dir) + 1);
+
+	free(name);
+	errno = error;
+
+	return (tb);
+}
+
+/*
+ * Create the directory dir and its parents unless they exist.  Return
+ * 0 on success, -1 on error with errno set.
+ */
+static int
+make_directory(const char *dir)
+{
+	char *path, *p;
+	int error;
+
+	if (mkdir(dir, 0755) == 0 || errno == EEXIST)
+		return (0);
+
+	if (errno != ENOENT)
+		return (-1);
+
+	path = strdup(dir);
+	if (path == NULL)
+		return (-1);
+
+	/* create the parents one after another */
+	for (p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+			error = errno;
+			free(path);
+			errno = error;
+			return (-1);
+		}
+
+		*p = '/';
+	}
+
+	free(path);
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Remove the cache files in dir other than the one called keep.  Only
+ * files of the user that begin like a cache file are removed, so other
+ * files in dir are safe.  Errors are ignored as the files only take up
+ * space.
+ */
+static void
+prune_cache(const char *dir, const char *keep)
+{
+	DIR *d;
+	struct dirent *ent;
+	struct stat st;
+	size_t len;
+	char magic[sizeof tbshm_magic];
+	int fd;
+
+	d = opendir(dir);
+	if (d == NULL)
+		return;
+
+	while (ent = readdir(d), ent != NULL) {
+		len = strlen(ent->d_name);
+		if (strncmp(ent->d_name, "dobutsu-", 8) != 0 || len < 3
+		    || strcmp(ent->d_name + len - 3, ".tb") != 0
+		    || strcmp(ent->d_name, keep) == 0)
+			continue;
+
+		fd = openat(dirfd(d), ent->d_name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+		if (fd == -1)
+			continue;
+
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == getuid()
+		    && pread(fd, magic, sizeof magic, 0) == sizeof magic
+		    && memcmp(magic, tbshm_magic, sizeof magic) == 0)
+			unlinkat(dirfd(d), ent->d_name, 0);
+
+		close(fd);
+	}
+
+	closedir(d);
+}
+
+/*
+ * Fill in the source_size, source_mtime, and source_checksum fields of
+ * key from the file fd.  The other fields are cleared.  Return 0 on
+ * success, -1 on error with errno set.
+ */
+static int
+source_key(struct tbshm_header *key, int fd)
+{
+	struct stat st;
+	off_t offset = 0;
+	ssize_t count;
+	uint8_t buf[1 << 16];
+
+	memset(key, 0, sizeof *key);
+	if (fstat(fd, &st) != 0)
+		return (-1);
+
+	key->source_size = st.st_size;
+	key->source_mtime = st.st_mtime;
+
+	while (count = pread(fd, buf, sizeof buf, offset), count != 0) {
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return (-1);
+		}
+
+		key->source_checksum = lzma_crc64(buf, count, key->source_checksum);
+		offset += count;
+	}
+
+	return (0);
+}
+
+/*
+ * Attach to the tablebase in the object called name (a shared memory
+ * object if shm is set, a file otherwise) if it is complete and matches
+ * key.  If the object is incomplete, build it from f using decode
+ * unless another process is already doing so, in which case wait for
+ * it.  A complete object that does not match key or is found to be
+ * corrupt is replaced by a new one.  If built is not NULL, it is set
+ * when this process built the object.  Return the tablebase or NULL on
+ * failure with errno set.
+ */
+static struct tablebase *
+load_shared(const char *name, int shm, FILE *f, const struct tbshm_header *key,
+    int (*decode)(FILE *, struct tablebase *), int *built)
+{
+	struct tablebase *tb = NULL;
+	struct tbshm_header hdr;
+	ssize_t count;
+	int fd, error, complete;
+
+	for (;;) {
+		fd = open_object(name, shm, O_RDWR | O_CREAT);
+		if (fd == -1 && errno == EACCES)
+			fd = open_object(name, shm, O_RDONLY);
+
+		if (fd == -1)
+			return (NULL);
+
+		/* wait for whoever is building the object */
+		if (lock_shm(fd, F_RDLCK, 1) != 0)
+			break;
+
+		count = pread(fd, &hdr, sizeof hdr, 0);
+		complete = count == sizeof hdr && hdr.ready;
+		if (complete && check_header(&hdr, key) == 0) {
+			tb = attach_shm(fd);
+			if (tb != NULL || errno != EINVAL)
+				break;
+		}
+
+		/* the object is new, stale, or corrupt, try to build it */
+		lock_shm(fd, F_UNLCK, 0);
+		if (lock_shm(fd, F_WRLCK, 0) != 0) {
+			if (errno == EAGAIN || errno == EACCES) {
+				close(fd);
+				continue;
+			}
+
+			break;
+		}
+
+		/* never modify a complete object, others may have it mapped */
+		if (complete) {
+			if (replace_object(name, shm, fd) != 0)
+				break;
+
+			close(fd);
+			continue;
+		}
+
+		/* somebody could have finished between our locks */
+		count = pread(fd, &hdr, sizeof hdr, 0);
+		if (count != sizeof hdr || !hdr.ready) {
+			if (build_shm(fd, f, key, decode) != 0)
+				break;
+
+			if (built != NULL)
+				*built = 1;
+		}
+
+		close(fd);
+	}
+
+	error = errno;
+	close(fd);
+	errno = error;
+
+	return (tb);
+}
+
+/*
+ * Open the object called name (a shared memory object if shm is set, a
+ * file otherwise) with flags, creating it readable and writable only
+ * for the user if O_CREAT is given.  Objects not belonging to the user
+ * or root could have been prepared by somebody else to mislead us, so
+ * they are rejected with EPERM.  Return a file descriptor or -1 on
+ * error with errno set.
+ */
+static int
+open_object(const char *name, int shm, int flags)
+{
+	struct stat st;
+	int fd;
+
+	fd = shm ? shm_open(name, flags, 0600) : open(name, flags, 0600);
+	if (fd == -1)
+		return (-1);
+
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return (-1);
+	}
+
+	if (st.st_uid != getuid() && st.st_uid != 0) {
+		close(fd);
+		errno = EPERM;
+		return (-1);
+	}
+
+	return (fd);
+}
+
+/*
+ * Unlink the complete but stale or corrupt object fd called name (a
+ * shared memory object if shm is set, a file otherwise), so the next
+ * attempt creates a new one.  The caller holds a write lock on fd.  If
+ * name already refers to another object, another process replaced it
+ * in the meantime, so it is left alone.  Return 0 on success or -1 on
+ * error with errno set.
+ */
+static int
+replace_object(const char *name, int shm, int fd)
+{
+	struct stat st, current;
+	int cfd;
+
+	if (fstat(fd, &st) != 0)
+		return (-1);
+
+	cfd = shm ? shm_open(name, O_RDONLY, 0) : open(name, O_RDONLY);
+	if (cfd == -1)
+		return (errno == ENOENT ? 0 : -1);
+
+	if (fstat(cfd, &current) != 0) {
+		close(cfd);
+		return (-1);
+	}
+
+	close(cfd);
+	if (current.st_dev != st.st_dev || current.st_ino != st.st_ino)
+		return (0);
+
+	return (shm ? shm_unlink(name) : unlink(name));
+}
+
+/*
+ * Apply a lock of type type (F_RDLCK, F_WRLCK, or F_UNLCK) to the
+ * header of the object fd.  If wait is set, wait until the lock can be
+ * acquired.  Return 0 on success, -1 on error.
+ */
+static int
+lock_shm(int fd, short type, int wait)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof fl);
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 0;
+	fl.l_len = sizeof(struct tbshm_header);
+
+	while (fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl) == -1)
+		if (errno != EINTR)
+			return (-1);
+
+	return (0);
+}
+
+/*
+ * Check if hdr describes a complete tablebase of the layout we expect,
+ * decompressed from the file described by key.  Return 0 if it does,
+ * -1 otherwise.
+ */
+static int
+check_header(const struct tbshm_header *hdr, const struct tbshm_header *key)
+{
+
+	if (memcmp(hdr->magic, tbshm_magic, sizeof tbshm_magic) != 0
+	    || hdr->version != TBSHM_VERSION || !hdr->ready
+	    || hdr->size != TB_DATA_SIZE)
+		return (-1);
+
+	if (hdr->source_size != key->source_size
+	    || hdr->source_mtime != key->source_mtime
+	    || hdr->source_checksum != key->source_checksum)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Map the complete tablebase in the object fd read-only and verify its
+ * checksum.  Return the tablebase or NULL on error with errno set.
+ */
+static struct tablebase *
+attach_shm(int fd)
+{
+	struct tablebase *tb;
+	struct tbshm_header hdr;
+	struct stat st;
+
+	if (pread(fd, &hdr, sizeof hdr, 0) != sizeof hdr)
+		return (NULL);
+
+	if (fstat(fd, &st) != 0)
+		return (NULL);
+
+	if (st.st_size < TBSHM_OFFSET + TB_DATA_SIZE) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	tb = map_tablebase(fd, TBSHM_OFFSET, TB_DATA_SIZE);
+	if (tb == NULL)
+		return (NULL);
+
+	if (lzma_crc64((const uint8_t *)tb->positions, TB_DATA_SIZE, 0) != hdr.checksum) {
+		free_tablebase(tb);
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	return (tb);
+}
+
+/*
+ * Decompress the tablebase in f into the object fd using decode and
+ * mark it as ready, recording key as its source.  The caller holds a
+ * write lock on fd.  Return 0 on success, -1 on error with errno set.
+ */
+static int
+build_shm(int fd, FILE *f, const struct tbshm_header *key,
+    int (*decode)(FILE *, struct tablebase *))
+{
+	struct tablebase tb;
+	struct tbshm_header hdr;
+	void *table;
+	off_t startpos;
+	int error;
+
+	if (startpos = ftello(f), startpos == -1)
+		return (-1);
+
+	/* discard whatever a dead process left behind */
+	memset(&hdr, 0, sizeof hdr);
+	if (pwrite(fd, &hdr, sizeof hdr, 0) != sizeof hdr)
+		return (-1);
+
+	/* allocate all space now instead of crashing on a full disk later */
+	error = posix_fallocate(fd, 0, TBSHM_OFFSET + TB_DATA_SIZE);
+	if (error != 0) {
+		errno = error;
+		return (-1);
+	}
+
+	table = mmap(NULL, TB_DATA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, TBSHM_OFFSET);
+	if (table == MAP_FAILED)
+		return (-1);
+
+	tb.positions = table;
+	tb.size = TB_DATA_SIZE;
+	tb.mapping = 0;
+	tb.cache = NULL;
+	tb.pack = NULL;
+	tb.live.bits = NULL;
+	tb.live.ranks = NULL;
+	tb.live.copy = NULL;
+	tb.wdl = 0;
+	if (decode(f, &tb) != 0 || fseeko(f, startpos, SEEK_SET) != 0) {
+		error = errno;
+		munmap(table, TB_DATA_SIZE);
+		errno = error;
+		return (-1);
+	}
+
+	hdr = *key;
+	memcpy(hdr.magic, tbshm_magic, sizeof tbshm_magic);
+	hdr.version = TBSHM_VERSION;
+	hdr.size = TB_DATA_SIZE;
+	hdr.checksum = lzma_crc64(table, TB_DATA_SIZE, 0);
+	munmap(table, TB_DATA_SIZE);
+
+	/* the tablebase must be on disk before the header says so */
+	if (fdatasync(fd) != 0)
+		return (-1);
+
+	/* the header is written last, the lock orders it for readers */
+	hdr.ready = 1;
+	if (pwrite(fd, &hdr, sizeof hdr, 0) != sizeof hdr)
+		return (-1);
+
+	return (0);
+}
@@ -22,101 +22,437 @@
  * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
  * SUCH DAMAGE.
  */
+#undef _XOPEN_SOURCE /* readline may define an older one */
+#define _XOPEN_SOURCE 700 /* for erand48() and open_memstream() */
 #include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "dobutsutable.h"
 
-static int validate_position(const struct tablebase *, poscode);
+/*
+ * The tablebase is validated in units of one lion position of one
+ * cohort of one ownership class.  The threads take units in order
+ * and write their error reports into a buffer for each unit.  Reports
+ * are printed in the order of the units as soon as all units before
+ * them are done, so the output is the same regardless of how many
+ * threads are used.  The lock protects next_unit, next_report, and
+ * the done flags of the units.
+ */
+struct validate_unit {
+	poscode pc;
+	char *report;
+	size_t len;
+	int done;
+};
+
+struct validate_state {
+	pthread_mutex_t lock;
+	const struct tablebase *tb;
+	struct validate_unit *units;
+	size_t nunits, next_unit, next_report;
+	int result;
+};
+
+static void	*validate_worker(void *);
+static int	 validate_unit(const struct tablebase *, struct validate_unit *);
+static void	 print_reports(struct validate_state *);
+static int	 validate_position(const struct tablebase *, poscode, FILE *);
+static size_t	 sample_stratum(unsigned *, size_t, size_t, unsigned short [3]);
+static int	 compare_unsigned(const void *, const void *);
+static double	 upper_bound(size_t, size_t, double);
 
 /*
- * Check if the tablebase tb is internally consistent.  If any
- * error is found, information is printed to stderr.  This function
- * returns 1 on success, 0 on failure.
+ * Check if the tablebase tb is internally consistent using up to
+ * threads threads.  If any error is found, information is printed
+ * to stderr.  This function returns 1 on success, 0 on failure and
+ * -1 if the validation could not be carried out with errno indicating
+ * the reason.  Bitbases only know the distances to mate they search
+ * for, so they cannot be validated and errno is set to EOPNOTSUPP.
  */
 extern int
-validate_tablebase(const struct tablebase *tb)
+validate_tablebase(const struct tablebase *tb, int threads)
 {
+	struct validate_state vs;
+	pthread_t pool[GENTB_MAX_THREADS];
 	poscode pc;
-	unsigned size;
+	int i, error;
+
+	if (tb->wdl) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+
+	if (threads <= 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (threads > GENTB_MAX_THREADS)
+		threads = GENTB_MAX_THREADS;
+
+	vs.tb = tb;
+	vs.nunits = vs.next_unit = vs.next_report = 0;
+	vs.result = 1;
+	vs.units = malloc(OWNERSHIP_TOTAL_COUNT * COHORT_COUNT * LIONPOS_COUNT * sizeof *vs.units);
+	if (vs.units == NULL)
+		return (-1);
+
+	pc.map = 0;
+	for (pc.ownership = 0; pc.ownership < OWNERSHIP_TOTAL_COUNT; pc.ownership++)
+		for (pc.cohort = 0; pc.cohort < COHORT_COUNT; pc.cohort++) {
+			if (!has_valid_ownership(pc))
+				continue;
+
+			for (pc.lionpos = 0; pc.lionpos < LIONPOS_COUNT; pc.lionpos++) {
+				vs.units[vs.nunits].pc = pc;
+				vs.units[vs.nunits].report = NULL;
+				vs.units[vs.nunits].len = 0;
+				vs.units[vs.nunits].done = 0;
+				vs.nunits++;
+			}
+		}
+
+	error = pthread_mutex_init(&vs.lock, NULL);
+	if (error != 0) {
+		free(vs.units);
+		errno = error;
+		return (-1);
+	}
+
+	/* if we can't create all threads, make do with what we have */
+	for (i = 1; i < threads; i++) {
+		error = pthread_create(pool + i, NULL, validate_worker, (void*)&vs);
+		if (error != 0)
+			break;
+	}
+
+	threads = i;
+	validate_worker((void*)&vs);
+
+	for (i = 1; i < threads; i++)
+		pthread_join(pool[i], NULL);
+
+	/* all units are done by now */
+	print_reports(&vs);
+	assert(vs.next_report == vs.nunits);
+
+	pthread_mutex_destroy(&vs.lock);
+	free(vs.units);
+
+	return (vs.result);
+}
+
+/*
+ * Validate units of the tablebase in vs_arg, a struct validate_state,
+ * until no units are left.
+ */
+static void *
+validate_worker(void *vs_arg)
+{
+	struct validate_state *vs = vs_arg;
+	struct validate_unit *unit;
+	int result;
+
+	pthread_mutex_lock(&vs->lock);
+	while (vs->next_unit < vs->nunits) {
+		unit = vs->units + vs->next_unit++;
+		pthread_mutex_unlock(&vs->lock);
+
+		result = validate_unit(vs->tb, unit);
+
+		pthread_mutex_lock(&vs->lock);
+		vs->result &= result;
+		unit->done = 1;
+		print_reports(vs);
+	}
+
+	pthread_mutex_unlock(&vs->lock);
+
+	return (NULL);
+}
+
+/*
+ * Validate all positions in unit, writing error reports to unit->report.
+ * If no buffer can be allocated for the report, it is printed to
+ * stderr directly.  Return 1 if all positions are fine, 0 otherwise.
+ */
+static int
+validate_unit(const struct tablebase *tb, struct validate_unit *unit)
+{
+	FILE *report;
+	poscode pc = unit->pc;
+	unsigned size = cohort_size[pc.cohort].size;
 	int result = 1;
 
+	report = open_memstream(&unit->report, &unit->len);
+	for (pc.map = 0; pc.map < size; pc.map++)
+		result &= validate_position(tb, pc, report != NULL ? report : stderr);
+
+	if (report != NULL)
+		fclose(report);
+
+	return (result);
+}
+
+/*
+ * Print and release the reports of all units that are done and not
+ * preceded by units still in progress.  vs->lock must be held.
+ */
+static void
+print_reports(struct validate_state *vs)
+{
+	struct validate_unit *unit;
+
+	while (vs->next_report < vs->nunits && vs->units[vs->next_report].done) {
+		unit = vs->units + vs->next_report++;
+		if (unit->report == NULL)
+			continue;
+
+		fwrite(unit->report, 1, unit->len, stderr);
+		free(unit->report);
+		unit->report = NULL;
+	}
+}
+
+/*
+ * Check a random sample of about samples positions of tb and store
+ * the results to res.  The sample is stratified by ownership class
+ * and cohort: each stratum contributes a number of positions
+ * proportional to its size, but at least one, so small strata are
+ * covered, too.  Strata where more than half of the positions would
+ * be sampled are checked completely.  Within each stratum, positions
+ * are drawn without replacement.  res->rate is the error rate
+ * estimated from the strata weighted by their sizes, res->upper is
+ * the Clopper-Pearson upper bound for the error rate at the given
+ * confidence, treating the sample as if it was drawn uniformly.  The
+ * sample is determined by seed.  Errors are printed to stderr.  This
+ * function returns 0 on success and -1 on error with errno indicating
+ * the reason.  Like validate_tablebase(), this fails with EOPNOTSUPP
+ * for bitbases.
+ */
+extern int
+sample_tablebase(struct sample_result *res, const struct tablebase *tb,
+    size_t samples, unsigned long seed, double confidence)
+{
+	poscode pc;
+	size_t i, total = 0, stratum, count, errors;
+	unsigned *indices, size;
+	unsigned short xsubi[3];
+
+	if (tb->wdl) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+
+	if (samples == 0 || !(confidence > 0.0 && confidence < 1.0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	/* like srand48() */
+	xsubi[0] = 0x330e;
+	xsubi[1] = seed & 0xffffU;
+	xsubi[2] = seed >> 16 & 0xffffU;
+
+	for (pc.ownership = 0; pc.ownership < OWNERSHIP_TOTAL_COUNT; pc.ownership++)
+		for (pc.cohort = 0; pc.cohort < COHORT_COUNT; pc.cohort++)
+			if (has_valid_ownership(pc))
+				total += cohort_size[pc.cohort].size * LIONPOS_COUNT;
+
+	/* no stratum has more than POSITION_TOTAL_COUNT / OWNERSHIP_TOTAL_COUNT positions */
+	indices = malloc(POSITION_TOTAL_COUNT / OWNERSHIP_TOTAL_COUNT * sizeof *indices);
+	if (indices == NULL)
+		return (-1);
+
+	res->samples = res->errors = res->strata = 0;
+	res->rate = 0.0;
+
 	for (pc.ownership = 0; pc.ownership < OWNERSHIP_TOTAL_COUNT; pc.ownership++)
 		for (pc.cohort = 0; pc.cohort < COHORT_COUNT; pc.cohort++) {
 			if (!has_valid_ownership(pc))
 				continue;
 
 			size = cohort_size[pc.cohort].size;
-			for (pc.lionpos = 0; pc.lionpos < LIONPOS_COUNT; pc.lionpos++)
-				for (pc.map = 0; pc.map < size; pc.map++)
-					result &= validate_position(tb, pc);
+			stratum = size * LIONPOS_COUNT;
+			count = (double)samples * stratum / total + 0.5;
+			if (count == 0)
+				count = 1;
+
+			count = sample_stratum(indices, count, stratum, xsubi);
+			errors = 0;
+			for (i = 0; i < count; i++) {
+				pc.lionpos = indices[i] / size;
+				pc.map = indices[i] % size;
+				errors += !validate_position(tb, pc, stderr);
+			}
+
+			res->samples += count;
+			res->errors += errors;
+			res->strata++;
+			res->rate += (double)stratum / total * errors / count;
+		}
+
+	free(indices);
+	res->upper = upper_bound(res->samples, res->errors, confidence);
+
+	return (0);
+}
+
+/*
+ * Draw count distinct indices below stratum in ascending order into
+ * indices and return how many were drawn.  If count is more than
+ * half of stratum, all indices are returned instead.
+ */
+static size_t
+sample_stratum(unsigned *indices, size_t count, size_t stratum, unsigned short xsubi[3])
+{
+	size_t i, n = 0;
+
+	if (2 * count > stratum) {
+		for (i = 0; i < stratum; i++)
+			indices[i] = i;
+
+		return (stratum);
 	}
 
-	return (result);
+	/* draw until there are count distinct indices */
+	while (n < count) {
+		for (i = n; i < count; i++)
+			indices[i] = erand48(xsubi) * stratum;
+
+		qsort(indices, count, sizeof *indices, compare_unsigned);
+		for (i = n = 1; i < count; i++)
+			if (indices[i] != indices[n - 1])
+				indices[n++] = indices[i];
+	}
+
+	return (count);
+}
+
+/*
+ * Compare two unsigned ints for qsort().
+ */
+static int
+compare_unsigned(const void *ap, const void *bp)
+{
+	unsigned a = *(const unsigned *)ap, b = *(const unsigned *)bp;
+
+	return ((a > b) - (a < b));
+}
+
+/*
+ * Compute the one-sided Clopper-Pearson upper bound for the
+ * probability of failure after observing errors failures in samples
+ * trials at the given confidence, i.e. the probability p for which
+ * seeing at most errors failures has probability 1 - confidence.
+ * The binomial distribution function is monotonous in p, so p is
+ * found by bisection.
+ */
+static double
+upper_bound(size_t samples, size_t errors, double confidence)
+{
+	double lo, hi, mid, cdf, lchoose;
+	size_t i;
+	int iter;
+
+	if (errors >= samples)
+		return (1.0);
+
+	lo = (double)errors / samples;
+	hi = 1.0;
+	for (iter = 0; iter < 100; iter++) {
+		mid = (lo + hi) / 2;
+		cdf = 0.0;
+		for (i = 0; i <= errors; i++) {
+			lchoose = lgamma(samples + 1.0) - lgamma(i + 1.0) - lgamma(samples - i + 1.0);
+			cdf += exp(lchoose + i * log(mid) + (samples - i) * log1p(-mid));
+		}
+
+		if (cdf > 1.0 - confidence)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return (hi);
 }
 
 /*
  * Validate a single position by checking every position reachable from it and
  * making sure, that it's one better than the best reachable result.
+ * Errors are reported to report, including entries that cannot be read.
  */
 static int
-validate_position(const struct tablebase *tb, poscode pc)
+validate_position(const struct tablebase *tb, poscode pc, FILE *report)
 {
-	struct position p, bestp;
+	struct position p[MAX_MOVES + 1];
 	struct move moves[MAX_MOVES], bestmove;
-	size_t i, nmove;
-	tb_entry bestvalue = 1, actual;
+	size_t i, nmove, best = 0;
+	tb_entry bestvalue = 1, actual, entries[MAX_MOVES + 1];
+	int game_ended;
 
-	decode_poscode(&p, pc);
-	actual = lookup_position(tb, &p);
+	decode_poscode(p, pc);
 
 	/*
 	 * since we never look them up, don't care about positions
 	 * marked as checkmate.
 	 */
-	if (gote_in_check(&p))
+	if (gote_in_check(p))
 		return (1);
 
-	nmove = generate_moves(moves, &p);
+	/* look up the position and all positions reachable from it at once */
+	nmove = generate_moves(moves, p);
+	for (i = 0; i < nmove; i++) {
+		p[i + 1] = p[0];
+		game_ended = play_move(p + i + 1, moves + i);
+		assert (game_ended == 0);
+		(void)game_ended;
+	}
+
+	if (lookup_positions(tb, p, nmove + 1, entries) != 0) {
+		char posstr[MAX_POSSTR];
+
+		position_string(posstr, p);
+		fprintf(report, "%-24s cannot be looked up: %s\n", posstr, strerror(errno));
+		return (0);
+	}
+
+	actual = entries[0];
+
 	if (nmove == 0) {
 		char posstr[MAX_POSSTR];
 
 		if (actual == -1)
 			return (1);
 
-		position_string(posstr, &p);
-		fprintf(stderr, "%-24s (%3d) => (none)  => should be -1\n", posstr, (int)actual);
+		position_string(posstr, p);
+		fprintf(report, "%-24s (%3d) => (none)  => should be -1\n", posstr, (int)actual);
 		return (0);
 	}
 
 	/* compare all moves and see which one is the best */
-	nmove = generate_moves(moves, &p);
 	for (i = 0; i < nmove; i++) {
-		struct position pp = p;
-		int game_ended;
-		tb_entry e;
-
-		game_ended = play_move(&pp, moves + i);
-		assert (game_ended == 0);
-
-		e = lookup_position(tb, &pp);
-
 		/* the best move leads to the worst position (for the opponent) */
-		if (wdl_compare(bestvalue, e) >= 0) {
-			bestvalue = e;
-			bestmove = moves[i];
-			bestp = pp;
+		if (wdl_compare(bestvalue, entries[i + 1]) >= 0) {
+			bestvalue = entries[i + 1];
+			best = i;
 		}
 	}
 
 	if (next_dtm(actual) != bestvalue) {
 		char posstr[MAX_POSSTR], movstr[MAX_MOVSTR];
 
-		position_string(posstr, &p);
-		move_string(movstr, &p, &bestmove);
-		fprintf(stderr, "%-24s (%3d) => %-7s => ", posstr, (int)actual, movstr);
-		position_string(posstr, &bestp);
-		fprintf(stderr, "%-24s (%3d) should be %3d\n",
+		bestmove = moves[best];
+		position_string(posstr, p);
+		move_string(movstr, p, &bestmove);
+		fprintf(report, "%-24s (%3d) => %-7s => ", posstr, (int)actual, movstr);
+		position_string(posstr, p + best + 1);
+		fprintf(report, "%-24s (%3d) should be %3d\n",
 		    posstr, (int)bestvalue, (int)next_dtm(actual));
 
 		return (0);
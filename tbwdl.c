@@ -0,0 +1,432 @@
+/*-
+ * Copyright (c) 2026 Robert Clausecker. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <lzma.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "dobutsutable.h"
+
+/*
+ * The search for the distance to mate in a bitbase remembers what it
+ * found out about each position in a memo of MEMO_SIZE slots, so the
+ * iterations of the search and the searches for the positions looked
+ * up together do not search the same positions over and over again.
+ * Each slot holds for the position at offset key - 1 (0 if the slot is
+ * empty) that its distance to mate is larger than lower and at most
+ * upper.  Collisions replace the slot.
+ */
+enum {
+	MEMO_SIZE = 1 << 20,
+};
+
+struct wdl_memo {
+	uint32_t key;
+	signed char lower, upper;
+};
+
+struct wdl_search {
+	const struct tablebase *tb;
+	struct wdl_memo *memo;
+};
+
+static tb_entry	search_entry(struct wdl_search *, const struct position *);
+static void	prove_loss(struct wdl_search *, const struct position *, size_t, tb_entry *);
+static int	is_checkmate(const struct position *);
+static int	stored_wdl(const struct tablebase *, size_t);
+static int	probe_wdl(const struct tablebase *, const struct position *);
+static const struct wdl_memo *memo_find(const struct wdl_search *, const struct position *);
+static int	mate_within(struct wdl_search *, const struct position *, int, int);
+static int	win_within(struct wdl_search *, const struct position *, int);
+static int	loss_within(struct wdl_search *, const struct position *, int);
+
+/*
+ * Read a win/draw/loss bitbase from file f, which is assumed to have
+ * been opened in binary mode for reading.  The bitbase is mapped into
+ * memory if possible.  Return a tablebase for it on success or NULL on
+ * error with errno set.  If f does not hold a bitbase of the current
+ * layout or its entries are damaged, errno is set to EINVAL.
+ */
+extern struct tablebase *
+read_bitbase(FILE *f)
+{
+	struct tablebase *tb;
+	off_t startpos;
+	uint64_t crc;
+	unsigned char header[WDL_HEADER_LEN];
+	int error;
+
+	if (startpos = ftello(f), startpos == -1)
+		return (NULL);
+
+	if (fread(header, sizeof header, 1, f) != 1) {
+		if (!ferror(f))
+			errno = EINVAL;
+
+		return (NULL);
+	}
+
+	if (check_wdlheader(header, &crc) != 0)
+		return (NULL);
+
+	tb = map_tablebase(fileno(f), startpos + TB_HEADER_SIZE, WDL_SIZE);
+	if (tb == NULL) {
+		if (fseeko(f, startpos + TB_HEADER_SIZE, SEEK_SET) == -1)
+			return (NULL);
+
+		tb = alloc_tablebase(WDL_SIZE);
+		if (tb == NULL)
+			return (NULL);
+
+		if (fread((void*)tb->positions, WDL_SIZE, 1, f) != 1) {
+			error = ferror(f) ? errno : EINVAL;
+			free_tablebase(tb);
+			errno = error;
+			return (NULL);
+		}
+	}
+
+	if (lzma_crc64((const uint8_t *)tb->positions, WDL_SIZE, 0) != crc) {
+		free_tablebase(tb);
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	tb->size = POSITION_COUNT;
+	tb->wdl = 1;
+
+	return (tb);
+}
+
+/*
+ * Look up the n positions in positions in the bitbase tb and store
+ * their values in out.  Draws are known right away.  For wins and
+ * losses, the distance to mate is found by an iteratively deepened
+ * search that only follows moves preserving the outcome: in a won
+ * position, moves to lost positions are tried, in a lost position all
+ * moves lead to won positions and must be searched.  If no mate is
+ * found within BITBASE_DEPTH moves, BITBASE_DEPTH + 1 (or its
+ * negation) is stored, which is a lower bound for the actual distance.
+ * If successors is set, the positions are the successors of one
+ * position and the lost ones are searched further (see prove_loss()),
+ * so the best move from that position is always known.
+ */
+extern void
+bitbase_entries(const struct tablebase *tb, const struct position *positions,
+    size_t n, tb_entry *out, int successors)
+{
+	struct wdl_search s;
+	size_t i;
+
+	/* without a memo, the search is just slower */
+	s.tb = tb;
+	s.memo = calloc(MEMO_SIZE, sizeof *s.memo);
+
+	for (i = 0; i < n; i++)
+		out[i] = search_entry(&s, positions + i);
+
+	if (successors)
+		prove_loss(&s, positions, n, out);
+
+	free(s.memo);
+}
+
+/*
+ * If some of the n positions with the values out are lost, but none
+ * is known to be lost within BITBASE_DEPTH moves, search the lost ones
+ * ever deeper until one of them is found to be lost within d moves.
+ * The positions found get the value -d, the other lost ones -(d + 1)
+ * as they are not lost within d moves.  Moving to one of the positions
+ * found then makes progress towards the mate.  As every lost position
+ * is lost within some number of moves, the search terminates, though
+ * for distant mates it takes a while.
+ */
+static void
+prove_loss(struct wdl_search *s, const struct position *positions, size_t n,
+    tb_entry *out)
+{
+	size_t i;
+	int d, found = 0, bounded = 0;
+
+	for (i = 0; i < n; i++)
+		if (out[i] == -(BITBASE_DEPTH + 1))
+			bounded = 1;
+		else if (is_loss(out[i]))
+			return;
+
+	if (!bounded)
+		return;
+
+	/* the lost positions not found yet hold -d, d their lower bound */
+	for (d = BITBASE_DEPTH + 1; !found; d++)
+		for (i = 0; i < n; i++)
+			if (out[i] == -d) {
+				if (mate_within(s, positions + i, WDL_LOSS, d))
+					found = 1;
+				else
+					out[i] = -(d + 1);
+			}
+}
+
+/*
+ * Find the value of p for bitbase_entries().
+ */
+static tb_entry
+search_entry(struct wdl_search *s, const struct position *p)
+{
+	int wdl, d;
+
+	wdl = probe_wdl(s->tb, p);
+	if (wdl == WDL_DRAW)
+		return (0);
+
+	for (d = 1; d <= BITBASE_DEPTH; d++)
+		if (mate_within(s, p, wdl, d))
+			return (wdl == WDL_WIN ? d : -d);
+
+	return (wdl == WDL_WIN ? BITBASE_DEPTH + 1 : -(BITBASE_DEPTH + 1));
+}
+
+/*
+ * Return 1 if the player to move in p can capture the opponent's lion,
+ * 0 otherwise.  Such positions are not stored in the table base.
+ */
+static int
+is_checkmate(const struct position *p)
+{
+
+	return (gote_moves(p) ? sente_in_check(p) : gote_in_check(p));
+}
+
+/*
+ * Return the entry at offset in the bitbase tb.
+ */
+static int
+stored_wdl(const struct tablebase *tb, size_t offset)
+{
+	const unsigned char *bits = (const unsigned char *)tb->positions;
+
+	return (bits[offset / 4] >> 2 * (offset % 4) & 3);
+}
+
+/*
+ * Return whether p is a win, a draw, or a loss as one of the WDL_*
+ * constants.  Like lookup_position(), the outcome of positions not in
+ * the table base is derived from their successors.
+ */
+static int
+probe_wdl(const struct tablebase *tb, const struct position *p)
+{
+	poscode pc;
+	struct move moves[MAX_MOVES];
+	struct position pp;
+	size_t i, nmove;
+	int game_ends, wdl = WDL_LOSS;
+
+	if (is_checkmate(p))
+		return (WDL_WIN);
+
+	encode_position(&pc, p);
+	if (ownership_map[pc.ownership] < OWNERSHIP_COUNT)
+		return (stored_wdl(tb, position_offset(pc)));
+
+	nmove = generate_moves(moves, p);
+	for (i = 0; i < nmove; i++) {
+		pp = *p;
+		game_ends = play_move(&pp, moves + i);
+		assert(!game_ends);
+		(void)game_ends;
+
+		/* moving into check cannot be an improval */
+		if (is_checkmate(&pp))
+			continue;
+
+		encode_position(&pc, &pp);
+		switch (stored_wdl(tb, position_offset(pc))) {
+		case WDL_LOSS:
+			return (WDL_WIN);
+
+		case WDL_DRAW:
+			wdl = WDL_DRAW;
+			break;
+		}
+	}
+
+	return (wdl);
+}
+
+/*
+ * Return the memo slot of p if the memo holds it, NULL otherwise.
+ */
+static const struct wdl_memo *
+memo_find(const struct wdl_search *s, const struct position *p)
+{
+	poscode pc;
+	const struct wdl_memo *m;
+	size_t offset;
+
+	encode_position(&pc, p);
+	offset = position_offset(pc);
+	m = s->memo + (offset * 0x9e3779b1UL & (MEMO_SIZE - 1));
+
+	return (m->key == offset + 1 ? m : NULL);
+}
+
+/*
+ * Return 1 if p, a position with outcome wdl (WDL_WIN or WDL_LOSS), is
+ * won or lost in at most d moves, 0 if not.  The memo is consulted
+ * first and updated with the result.
+ */
+static int
+mate_within(struct wdl_search *s, const struct position *p, int wdl, int d)
+{
+	poscode pc;
+	struct wdl_memo *m = NULL;
+	size_t offset;
+	int result;
+
+	if (d < 1)
+		return (0);
+
+	/* checkmates are won in one move and not in the table base */
+	if (is_checkmate(p))
+		return (1);
+
+	if (s->memo != NULL) {
+		encode_position(&pc, p);
+		offset = position_offset(pc);
+		m = s->memo + (offset * 0x9e3779b1UL & (MEMO_SIZE - 1));
+		if (m->key != offset + 1) {
+			m->key = offset + 1;
+			m->lower = 0;
+			m->upper = SCHAR_MAX;
+		} else if (d >= m->upper)
+			return (1);
+		else if (d <= m->lower)
+			return (0);
+	}
+
+	if (wdl == WDL_WIN)
+		result = win_within(s, p, d);
+	else
+		result = loss_within(s, p, d);
+
+	/* the slot may have been taken over by the search */
+	if (m != NULL && m->key == offset + 1) {
+		if (result)
+			m->upper = d;
+		else
+			m->lower = d;
+	}
+
+	return (result);
+}
+
+/*
+ * Return 1 if p, a won position that is not a checkmate, is won in at
+ * most d > 0 moves, 0 if not.  Only moves to lost positions are
+ * searched.
+ */
+static int
+win_within(struct wdl_search *s, const struct position *p, int d)
+{
+	struct move moves[MAX_MOVES];
+	struct position pp[MAX_MOVES];
+	const struct wdl_memo *m;
+	size_t i, k = 0, n = 0, nmove;
+
+	nmove = generate_moves(moves, p);
+	for (i = 0; i < nmove; i++) {
+		pp[n] = *p;
+		if (play_move(pp + n, moves + i))
+			return (1);
+
+		/* moving into check loses */
+		if (!is_checkmate(pp + n))
+			n++;
+	}
+
+	if (d == 1)
+		return (0);
+
+	/* a successor the memo knows to be lost in time settles p */
+	for (i = 0; i < n; i++)
+		if (probe_wdl(s->tb, pp + i) == WDL_LOSS) {
+			m = s->memo == NULL ? NULL : memo_find(s, pp + i);
+			if (m != NULL && d - 1 >= m->upper)
+				return (1);
+			pp[k++] = pp[i];
+		}
+
+	for (i = 0; i < k; i++)
+		if (mate_within(s, pp + i, WDL_LOSS, d - 1))
+			return (1);
+
+	return (0);
+}
+
+/*
+ * Return 1 if p, a lost position, is lost in at most d > 0 moves, 0 if
+ * not.  All moves from p lead to won positions, so all of them are
+ * searched.
+ */
+static int
+loss_within(struct wdl_search *s, const struct position *p, int d)
+{
+	struct move moves[MAX_MOVES];
+	struct position pp[MAX_MOVES];
+	const struct wdl_memo *m;
+	size_t i, n = 0, nmove;
+
+	nmove = generate_moves(moves, p);
+	for (i = 0; i < nmove; i++) {
+		pp[n] = *p;
+
+		/* cannot happen as p is lost */
+		if (play_move(pp + n, moves + i))
+			return (0);
+
+		/* moving into check loses in one move */
+		if (is_checkmate(pp + n))
+			continue;
+
+		/* a successor the memo knows not to be won in time refutes p */
+		m = s->memo == NULL ? NULL : memo_find(s, pp + n);
+		if (m != NULL && d <= m->lower)
+			return (0);
+
+		n++;
+	}
+
+	for (i = 0; i < n; i++)
+		if (!mate_within(s, pp + i, WDL_WIN, d))
+			return (0);
+
+	return (1);
+}
@@ -22,35 +22,164 @@
  * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
  * SUCH DAMAGE.
  */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "tablebase.h"
 
+/*
+ * Validate the Dobutsu Shogi endgame tablebase.  The option -m memory
+ * controls how memory for the tablebase is allocated.  The option
+ * -j nproc sets the number of threads used for validation and for
+ * decompressing the tablebase.
+ *
+ * With -n samples, only a random sample of about samples positions is
+ * checked and bounds for the error rate of the whole tablebase are
+ * printed at the confidence given with -c confidence (default 0.95).
+ * Instead of a sample size, -r rate can be given to check enough
+ * positions that, if no error is found, the error rate is shown to be
+ * below rate at the requested confidence.  The option -s seed selects
+ * the sample, by default a seed is derived from the current time.
+ */
 extern int
 main(int argc, char *argv[])
 {
 	struct tablebase *tb;
+	struct sample_result res;
 	FILE *tbfile;
+	double confidence = 0.95, rate = 0.0, samples = 0.0;
+	unsigned long seed = time(NULL);
+	long threads = 1;
+	int optchar, flags, result;
+	char *endptr;
+
+	while (optchar = getopt(argc, argv, "c:j:m:n:r:s:"), optchar != -1)
+		switch (optchar) {
+		case 'c':
+			confidence = strtod(optarg, &endptr);
+			if (*optarg == '\0' || *endptr != '\0' || !(confidence > 0.0 && confidence < 1.0)) {
+				fprintf(stderr, "A confidence between 0 and 1 is expected\n");
+				return (EXIT_FAILURE);
+			}
+
+			break;
+
+		case 'j':
+			threads = strtol(optarg, &endptr, 0);
+			if (*optarg == '\0' || *endptr != '\0' || threads <= 0) {
+				fprintf(stderr, "A positive number of threads is expected\n");
+				return (EXIT_FAILURE);
+			}
+
+			if (threads > INT_MAX)
+				threads = INT_MAX;
+
+			break;
+
+		case 'm':
+			flags = parse_tablebase_memory(optarg);
+			if (flags == -1) {
+				fprintf(stderr, "Invalid memory options %s\n", optarg);
+				return (EXIT_FAILURE);
+			}
+
+			set_tablebase_memory(flags);
+			break;
+
+		case 'n':
+			samples = strtod(optarg, &endptr);
+			if (*optarg == '\0' || *endptr != '\0' || !(samples >= 1.0)) {
+				fprintf(stderr, "A positive number of samples is expected\n");
+				return (EXIT_FAILURE);
+			}
+
+			break;
+
+		case 'r':
+			rate = strtod(optarg, &endptr);
+			if (*optarg == '\0' || *endptr != '\0' || !(rate > 0.0 && rate < 1.0)) {
+				fprintf(stderr, "An error rate between 0 and 1 is expected\n");
+				return (EXIT_FAILURE);
+			}
+
+			break;
+
+		case 's':
+			seed = strtoul(optarg, &endptr, 0);
+			if (*optarg == '\0' || *endptr != '\0') {
+				fprintf(stderr, "A numeric seed is expected\n");
+				return (EXIT_FAILURE);
+			}
 
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s game.db\n", argv[0]);
+			break;
+
+		case '?':
+		default:
+			goto usage;
+		}
+
+	if (argc - optind != 1) {
+	usage:
+		fprintf(stderr, "Usage: %s [-j nproc] [-m memory] [-n samples | -r rate] [-c confidence]\n"
+		    "       [-s seed] game.db\n", argv[0]);
 		return (EXIT_FAILURE);
 	}
 
-	tbfile = fopen(argv[1], "rb");
+	tbfile = fopen(argv[optind], "rb");
 	if (tbfile == NULL) {
 		perror("fopen");
 		return (EXIT_FAILURE);
 	}
 
+	set_tablebase_decoder(threads, 0);
 	tb = read_tablebase(tbfile);
 	if (tb == NULL) {
 		perror("read_tablebase");
 		return (EXIT_FAILURE);
 	}
 
-	if (validate_tablebase(tb))
+	/* with no errors, we want (1 - rate)^samples <= 1 - confidence */
+	if (rate > 0.0)
+		samples = ceil(log(1.0 - confidence) / log1p(-rate));
+
+	if (samples > 0.0) {
+		if (samples > (double)((size_t)-1 >> 1))
+			samples = (double)((size_t)-1 >> 1);
+
+		if (sample_tablebase(&res, tb, (size_t)samples, seed, confidence) != 0) {
+			if (errno == EOPNOTSUPP)
+				fprintf(stderr, "%s: bitbases cannot be validated\n", argv[optind]);
+			else
+				perror("sample_tablebase");
+
+			return (EXIT_FAILURE);
+		}
+
+		printf("Seed %lu: %zu errors in %zu samples from %zu strata\n",
+		    seed, res.errors, res.samples, res.strata);
+		printf("Error rate %g, at most %g with confidence %g\n",
+		    res.rate, res.upper, confidence);
+
+		return (res.errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	result = validate_tablebase(tb, threads);
+	if (result == -1) {
+		if (errno == EOPNOTSUPP)
+			fprintf(stderr, "%s: bitbases cannot be validated\n", argv[optind]);
+		else
+			perror("validate_tablebase");
+
+		return (EXIT_FAILURE);
+	}
+
+	if (result)
 		return (EXIT_SUCCESS);
 	else
 		return (EXIT_FAILURE);